@@ -0,0 +1,131 @@
+/// Times `downscale_area`, with each implementation this CPU supports,
+/// against `gdk_pixbuf_scale_simple`, scaling images of common sizes down to
+/// the notification image size.
+
+#include <algorithm>
+#include <chrono>
+#include <functional>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <clara.hpp>
+#include <fmt/format.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+
+#include "../downscale.hpp"
+
+namespace cloth::notifications::bench {
+
+  using clock = std::chrono::steady_clock;
+  using detail::SimdLevel;
+
+  /// Size of the notification image
+  constexpr int target_size = 100;
+
+  struct Options {
+    int iterations = 50;
+    bool show_help = false;
+
+    auto make_cli()
+    {
+      using namespace clara;
+      // clang-format off
+      return Parser{} | Help(show_help)
+             | Opt(iterations, "count")
+               ["--iterations"]
+               ("Times to scale every image with every method");
+      // clang-format on
+    }
+  };
+
+  /// Mean milliseconds per call of `f`
+  auto time(int iterations, const std::function<void()>& f) -> double
+  {
+    // Once untimed, to fault in the destination and warm the caches
+    f();
+    auto start = clock::now();
+    for (int i = 0; i < iterations; i++) f();
+    return std::chrono::duration<double, std::milli>(clock::now() - start).count() / iterations;
+  }
+
+  auto run(const Options& opts) -> int
+  {
+    struct Size {
+      int width, height;
+    };
+    const std::vector<Size> sizes = {
+      {256, 256}, {512, 512}, {1024, 768}, {1920, 1080}, {3840, 2160},
+    };
+
+    std::vector<std::pair<const char*, SimdLevel>> levels = {{"scalar", SimdLevel::Scalar}};
+    auto supported = detail::downscale_simd_level();
+    if (supported >= SimdLevel::SSE2) levels.push_back({"sse2", SimdLevel::SSE2});
+    if (supported >= SimdLevel::AVX2) levels.push_back({"avx2", SimdLevel::AVX2});
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> byte(0, 255);
+
+    std::cout << fmt::format("{:<12} {:>3} {:<16} {:>9} {:>9}\n", "source", "ch", "method",
+                             "ms", "vs gdk");
+    for (int channels : {3, 4}) {
+      for (auto& size : sizes) {
+        auto* src = gdk_pixbuf_new(GDK_COLORSPACE_RGB, channels == 4, 8, size.width, size.height);
+        int stride = gdk_pixbuf_get_rowstride(src);
+        auto* pixels = gdk_pixbuf_get_pixels(src);
+        for (int i = 0; i < stride * size.height; i++) pixels[i] = uint8_t(byte(rng));
+
+        // Fit within the notification image, like the image loader does
+        double scale =
+          std::min(double(target_size) / size.width, double(target_size) / size.height);
+        int width = std::max(int(size.width * scale), 1);
+        int height = std::max(int(size.height * scale), 1);
+        int dst_stride = width * channels;
+        std::vector<uint8_t> dst(std::size_t(dst_stride) * height);
+
+        auto gdk = [&](GdkInterpType interp) {
+          return time(opts.iterations, [&] {
+            g_object_unref(gdk_pixbuf_scale_simple(src, width, height, interp));
+          });
+        };
+        double bilinear = gdk(GDK_INTERP_BILINEAR);
+        double tiles = gdk(GDK_INTERP_TILES);
+
+        auto source = fmt::format("{}x{}", size.width, size.height);
+        auto print = [&](const char* method, double ms) {
+          std::cout << fmt::format("{:<12} {:>3} {:<16} {:>9.3f} {:>8.2f}x\n", source, channels,
+                                   method, ms, bilinear / ms);
+        };
+        print("gdk bilinear", bilinear);
+        print("gdk tiles", tiles);
+        for (auto& [name, level] : levels) {
+          print(name, time(opts.iterations, [&, level = level] {
+                  detail::downscale_area(level, pixels, size.width, size.height, stride,
+                                         dst.data(), width, height, dst_stride, channels);
+                }));
+        }
+        g_object_unref(src);
+      }
+    }
+    return 0;
+  }
+
+} // namespace cloth::notifications::bench
+
+int main(int argc, char* argv[])
+{
+  using namespace cloth::notifications::bench;
+
+  Options opts;
+  auto cli = opts.make_cli();
+  auto result = cli.parse(clara::Args(argc, argv));
+  if (!result) {
+    std::cerr << "Error in command line: " << result.errorMessage() << "\n";
+    return 1;
+  }
+  if (opts.show_help) {
+    std::cout << cli;
+    return 1;
+  }
+  return run(opts);
+}
@@ -0,0 +1,283 @@
+/// Floods the notification server with `Notify` calls, and reports
+/// throughput, call latency, and the resource usage of the server.
+///
+/// Run through run-flood.sh, or `meson test --benchmark`, to get a private
+/// session bus and a headless compositor.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <fstream>
+#include <functional>
+#include <iostream>
+#include <limits>
+#include <thread>
+#include <vector>
+
+#include <clara.hpp>
+#include <fmt/format.h>
+#include <giomm.h>
+
+namespace cloth::notifications::bench {
+
+  using clock = std::chrono::steady_clock;
+
+  const std::string server_name = "org.freedesktop.Notifications";
+  const std::string server_path = "/org/freedesktop/Notifications";
+  const std::string vendor_interface = "org.tablecloth.Notifications";
+
+  struct Options {
+    std::string workload = "burst";
+    int count = 1000;
+    int concurrency = 32;
+    int image_size = 256;
+    int actions = 8;
+    double wait = 10;
+    double settle = 1;
+    bool show_help = false;
+
+    auto make_cli()
+    {
+      using namespace clara;
+      // clang-format off
+      return Parser{} | Help(show_help)
+             | Opt(workload, "burst|replace|image|actions")
+               ["--workload"]
+               ("What to send. burst: plain notifications, replace: all replace the same id, "
+                "image: with image-data, actions: with many actions")
+             | Opt(count, "count")
+               ["--count"]
+               ("Number of notifications to send")
+             | Opt(concurrency, "calls")
+               ["--concurrency"]
+               ("Number of Notify calls in flight at once")
+             | Opt(image_size, "pixels")
+               ["--image-size"]
+               ("Width and height of the image-data sent by the image workload")
+             | Opt(actions, "count")
+               ["--actions"]
+               ("Number of actions sent by the actions workload")
+             | Opt(wait, "seconds")
+               ["--wait"]
+               ("How long to wait for the server to appear on the bus")
+             | Opt(settle, "seconds")
+               ["--settle"]
+               ("How long to let the server draw before collecting its stats");
+      // clang-format on
+    }
+  };
+
+  /// `VmHWM` and `Threads` from /proc/<pid>/status
+  struct ProcessStats {
+    long peak_rss_kb = -1;
+    long threads = -1;
+  };
+
+  auto process_stats(unsigned pid) -> ProcessStats
+  {
+    ProcessStats res;
+    std::ifstream status(fmt::format("/proc/{}/status", pid));
+    std::string key;
+    while (status >> key) {
+      if (key == "VmHWM:") status >> res.peak_rss_kb;
+      if (key == "Threads:") status >> res.threads;
+      status.ignore(std::numeric_limits<std::streamsize>::max(), '\n');
+    }
+    return res;
+  }
+
+  auto call_bus(const Glib::RefPtr<Gio::DBus::Connection>& connection,
+                const std::string& method,
+                GVariant* parameters) -> Glib::VariantContainerBase
+  {
+    return connection->call_sync("/org/freedesktop/DBus", "org.freedesktop.DBus", method,
+                                 Glib::VariantContainerBase(parameters), "org.freedesktop.DBus");
+  }
+
+  /// Wait until the server owns its name, and return its pid, or 0 on timeout
+  auto wait_for_server(const Glib::RefPtr<Gio::DBus::Connection>& connection, double timeout)
+    -> unsigned
+  {
+    auto deadline = clock::now() + std::chrono::duration<double>(timeout);
+    while (true) {
+      auto reply = call_bus(connection, "NameHasOwner", g_variant_new("(s)", server_name.c_str()));
+      gboolean has_owner;
+      g_variant_get(reply.gobj(), "(b)", &has_owner);
+      if (has_owner) break;
+      if (clock::now() > deadline) return 0;
+      std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    auto reply = call_bus(connection, "GetConnectionUnixProcessID",
+                          g_variant_new("(s)", server_name.c_str()));
+    guint32 pid;
+    g_variant_get(reply.gobj(), "(u)", &pid);
+    return pid;
+  }
+
+  auto image_data_hint(int size) -> GVariant*
+  {
+    std::vector<uint8_t> pixels(std::size_t(size) * size * 4);
+    for (int y = 0; y < size; y++) {
+      for (int x = 0; x < size; x++) {
+        auto* px = &pixels[(std::size_t(y) * size + x) * 4];
+        px[0] = uint8_t(x * 255 / size);
+        px[1] = uint8_t(y * 255 / size);
+        px[2] = 128;
+        px[3] = 255;
+      }
+    }
+    auto* bytes = g_variant_new_fixed_array(G_VARIANT_TYPE_BYTE, pixels.data(), pixels.size(), 1);
+    return g_variant_new("(iiibii@ay)", size, size, size * 4, TRUE, 8, 4, bytes);
+  }
+
+  /// The arguments of a `Notify` call for the given workload
+  auto notify_parameters(const Options& opts, int index, guint32 replaces_id)
+    -> Glib::VariantContainerBase
+  {
+    GVariantBuilder hints;
+    g_variant_builder_init(&hints, G_VARIANT_TYPE("a{sv}"));
+    g_variant_builder_add(&hints, "{sv}", "urgency", g_variant_new_byte(1));
+    if (opts.workload == "image") {
+      g_variant_builder_add(&hints, "{sv}", "image-data", image_data_hint(opts.image_size));
+    }
+
+    std::vector<std::string> actions;
+    if (opts.workload == "actions") {
+      for (int i = 0; i < opts.actions; i++) {
+        actions.push_back(fmt::format("action-{}", i));
+        actions.push_back(fmt::format("Action {}", i));
+      }
+    }
+    std::vector<const char*> action_ptrs;
+    for (auto& action : actions) action_ptrs.push_back(action.c_str());
+    action_ptrs.push_back(nullptr);
+
+    auto summary = fmt::format("Flood {} #{}", opts.workload, index);
+    return Glib::VariantContainerBase(g_variant_new(
+      "(susss@as@a{sv}i)", "cloth-notifications-flood", replaces_id, "", summary.c_str(),
+      "The quick brown fox jumps over the lazy dog", g_variant_new_strv(action_ptrs.data(), -1),
+      g_variant_builder_end(&hints), 5000));
+  }
+
+  auto percentile(std::vector<clock::duration>& samples, double quantile) -> double
+  {
+    if (samples.empty()) return 0;
+    std::sort(samples.begin(), samples.end());
+    auto index = std::size_t(std::ceil(quantile * samples.size()));
+    index = std::clamp<std::size_t>(index, 1, samples.size()) - 1;
+    return std::chrono::duration<double, std::milli>(samples[index]).count();
+  }
+
+  auto print_server_latency(const Glib::RefPtr<Gio::DBus::Connection>& connection) -> void
+  {
+    try {
+      auto reply = connection->call_sync(server_path, vendor_interface, "GetLatencyStats", {},
+                                         server_name);
+      GVariantIter* iter;
+      g_variant_get(reply.gobj(), "(a{s(ttttttt)})", &iter);
+      const gchar* stage;
+      guint64 count, min, mean, p50, p90, p99, max;
+      fmt::print("{:<13} {:>8} {:>10} {:>10} {:>10}\n", "server stage", "count", "p50 ms",
+                 "p99 ms", "max ms");
+      while (g_variant_iter_loop(iter, "{&s(ttttttt)}", &stage, &count, &min, &mean, &p50, &p90,
+                                 &p99, &max)) {
+        fmt::print("{:<13} {:>8} {:>10.3f} {:>10.3f} {:>10.3f}\n", stage, count, p50 / 1000.0,
+                   p99 / 1000.0, max / 1000.0);
+      }
+      g_variant_iter_free(iter);
+    } catch (const Glib::Error& e) {
+      std::cerr << "Could not get server latency stats: " << e.what() << "\n";
+    }
+  }
+
+  auto run(const Options& opts) -> int
+  {
+    auto connection = Gio::DBus::Connection::get_sync(Gio::DBus::BUS_TYPE_SESSION);
+    auto pid = wait_for_server(connection, opts.wait);
+    if (pid == 0) {
+      std::cerr << "Timed out waiting for " << server_name << "\n";
+      return 1;
+    }
+
+    guint32 replaces_id = 0;
+    if (opts.workload == "replace") {
+      auto reply = connection->call_sync(server_path, server_name, "Notify",
+                                         notify_parameters(opts, 0, 0), server_name);
+      g_variant_get(reply.gobj(), "(u)", &replaces_id);
+    }
+    // Only measure this run, in case the server was started by someone else
+    connection->call_sync(server_path, vendor_interface, "ResetLatencyStats", {}, server_name);
+
+    auto loop = Glib::MainLoop::create();
+    std::vector<clock::duration> latencies;
+    latencies.reserve(opts.count);
+    int sent = 0;
+    int done = 0;
+    int errors = 0;
+
+    std::function<void()> send_next = [&] {
+      int index = sent++;
+      auto start = clock::now();
+      connection->call(
+        server_path, server_name, "Notify", notify_parameters(opts, index, replaces_id),
+        [&, start](Glib::RefPtr<Gio::AsyncResult>& result) {
+          try {
+            connection->call_finish(result);
+            latencies.push_back(clock::now() - start);
+          } catch (const Glib::Error& e) {
+            if (errors++ == 0) std::cerr << "Notify failed: " << e.what() << "\n";
+          }
+          if (++done == opts.count) loop->quit();
+          else if (sent < opts.count) send_next();
+        },
+        server_name);
+    };
+
+    auto start = clock::now();
+    for (int i = 0; i < std::min(opts.concurrency, opts.count); i++) send_next();
+    if (opts.count > 0) loop->run();
+    auto elapsed = std::chrono::duration<double>(clock::now() - start).count();
+
+    // Let the server map and draw what it was sent
+    std::this_thread::sleep_for(std::chrono::duration<double>(opts.settle));
+    auto proc = process_stats(pid);
+
+    fmt::print("{:<13} {}\n", "workload", opts.workload);
+    fmt::print("{:<13} {} ({} failed)\n", "notifications", opts.count, errors);
+    fmt::print("{:<13} {:.3f} s\n", "elapsed", elapsed);
+    fmt::print("{:<13} {:.1f} /s\n", "throughput", opts.count / elapsed);
+    fmt::print("{:<13} {:.3f} ms\n", "notify p50", percentile(latencies, 0.5));
+    fmt::print("{:<13} {:.3f} ms\n", "notify p99", percentile(latencies, 0.99));
+    fmt::print("{:<13} {:.1f} MiB\n", "peak rss", proc.peak_rss_kb / 1024.0);
+    fmt::print("{:<13} {}\n", "threads", proc.threads);
+    print_server_latency(connection);
+
+    return errors == 0 ? 0 : 1;
+  }
+
+} // namespace cloth::notifications::bench
+
+int main(int argc, char* argv[])
+{
+  using namespace cloth::notifications::bench;
+  Gio::init();
+
+  Options opts;
+  auto cli = opts.make_cli();
+  auto result = cli.parse(clara::Args(argc, argv));
+  if (!result) {
+    std::cerr << "Error in command line: " << result.errorMessage() << "\n";
+    return 1;
+  }
+  if (opts.show_help) {
+    std::cout << cli;
+    return 1;
+  }
+
+  try {
+    return run(opts);
+  } catch (const Glib::Error& e) {
+    std::cerr << e.what() << "\n";
+    return 1;
+  }
+}
@@ -0,0 +1,45 @@
+#!/usr/bin/env bash
+# Run cloth-notifications on a private session bus and a headless wlroots
+# compositor, and flood it with notifications.
+#
+# usage: run-flood.sh COMPOSITOR CLOTH_NOTIFICATIONS FLOOD [FLOOD_ARGS...]
+#
+# COMPOSITOR is normally the rootston built in subprojects/wlroots. If it
+# does not exist, rootston is taken from PATH. Set CLOTH_BENCH_COMPOSITOR to
+# use another compositor, and CLOTH_BENCH_LOG to keep the compositor and
+# server output.
+
+set -euo pipefail
+
+if [ -z "${CLOTH_BENCH_INNER:-}" ]; then
+  export CLOTH_BENCH_INNER=1
+  exec dbus-run-session -- "$0" "$@"
+fi
+
+compositor=$1
+notifications=$2
+flood=$3
+shift 3
+
+if [ -n "${CLOTH_BENCH_COMPOSITOR:-}" ]; then
+  compositor=$CLOTH_BENCH_COMPOSITOR
+elif [ ! -x "$compositor" ]; then
+  compositor=rootston
+fi
+
+export WLR_BACKENDS=headless
+export WLR_HEADLESS_OUTPUTS=1
+export WLR_LIBINPUT_NO_DEVICES=1
+export GDK_BACKEND=wayland
+unset WAYLAND_DISPLAY DISPLAY
+if [ -z "${XDG_RUNTIME_DIR:-}" ]; then
+  XDG_RUNTIME_DIR=$(mktemp -d)
+  export XDG_RUNTIME_DIR
+fi
+
+# The compositor starts the server once its wayland socket is up
+"$compositor" -E "$notifications" >"${CLOTH_BENCH_LOG:-/dev/null}" 2>&1 &
+compositor_pid=$!
+trap 'kill "$compositor_pid" 2>/dev/null; wait "$compositor_pid" 2>/dev/null || true' EXIT
+
+"$flood" "$@"
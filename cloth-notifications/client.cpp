@@ -1,14 +1,17 @@
 #include "client.hpp"
 
+#include <chrono>
 #include <iostream>
 
 #include "util/logging.hpp"
 
+#include "offscreen-render.hpp"
+
 namespace cloth::notifications {
 
   auto Client::bind_interfaces()
   {
-    registry = display.get_registry();
+    registry = display->get_registry();
     registry.on_global() = [&](uint32_t name, std::string interface, uint32_t version) {
       cloth_debug("Global: {}", interface);
       if (interface == layer_shell.interface_name) {
@@ -18,22 +21,36 @@ namespace cloth::notifications {
         registry.bind(name, output, version);
       }
     };
-    display.roundtrip();
+    display->roundtrip();
   }
 
-  auto Client::dbus_main() -> void
+  auto Client::init_gtk() -> void
   {
-    DBus::default_dispatcher = &dispatcher;
-
-    DBus::Connection conn = DBus::Connection::SessionBus();
-    bool status = conn.acquire_name(NotificationServer::server_name.c_str());
-    if (!status) {
-      cloth_error("Could not acquire notification server name");
-    };
+    if (gtk_main) return;
+    gtk_main.emplace(_argc, _argv);
+    gdk_display = Gdk::Display::get_default();
+    style_context = Gtk::StyleContext::create();
+    css_provider = Gtk::CssProvider::create();
+    if (!css_provider->load_from_path(css_file)) {
+      cloth_error("Error loading CSS file");
+    }
+  }
 
-    NotificationServer server(*this, conn);
+  auto Client::init_ui() -> void
+  {
+    if (has_ui()) return;
+    auto start = std::chrono::steady_clock::now();
+    init_gtk();
+    display.emplace(gdk_wayland_display_get_wl_display(gdk_display->gobj()));
+    bind_interfaces();
+    cloth_debug("UI initialized in {}us", std::chrono::duration_cast<std::chrono::microseconds>(
+                                             std::chrono::steady_clock::now() - start)
+                                             .count());
+  }
 
-    dispatcher.enter();
+  auto Client::quit() -> void
+  {
+    if (main_loop) main_loop->quit();
   }
 
   int Client::main(int argc, char* argv[])
@@ -50,13 +67,30 @@ namespace cloth::notifications {
       return 1;
     }
 
-    bind_interfaces();
+    if (!render_png.empty()) {
+      init_gtk();
+      return render_offscreen(*this);
+    }
+
+    // GDBus only needs GIO. With --lazy, the server initializes the rest
+    // when the first notification arrives
+    Gio::init();
+    if (!lazy) init_ui();
 
-    dbus_thread = std::thread(&Client::dbus_main, this);
+    main_loop = Glib::MainLoop::create();
+    if (!replay_file.empty()) {
+      // Next to a running server, which keeps the bus name and the history
+      server = std::make_unique<NotificationServer>(*this, NotificationServer::replay);
+      replay = std::make_unique<TraceReplay>(*server, replay_file, replay_speed);
+      replay->start();
+    } else {
+      server = std::make_unique<NotificationServer>(*this);
+    }
 
-    gtk_main.run();
+    main_loop->run();
 
-    dispatcher.leave();
+    replay.reset();
+    server.reset();
     return 0;
   }
 
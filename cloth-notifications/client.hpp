@@ -1,9 +1,10 @@
 #pragma once
 
+#include <optional>
+
 #include <clara.hpp>
 
 #include <gtkmm.h>
-#include <thread>
 #include <wayland-client.hpp>
 
 #include <protocols.hpp>
@@ -21,35 +22,66 @@ namespace cloth::notifications {
 
   struct Client {
     int height = 26;
+    int max_visible = 5;
+    bool single_surface = false;
+    int coalesce_ms = 0;
+    int image_budget_mb = 32;
+    double rate_low = 0;
+    double rate_normal = 0;
+    double rate_burst = 10;
+    std::string rate_key = "sender";
+    bool rate_drop = false;
+    bool lazy = false;
+    int exit_idle_s = 0;
+    int trim_idle_s = 60;
+    std::string record_file;
+    std::string replay_file;
+    double replay_speed = 1;
+    std::string render_png;
+    std::string render_summary = "Notification summary";
+    std::string render_body = "The body of the notification, long enough to wrap onto more "
+                              "than one line in the default style";
+    std::string render_image;
+    int render_actions = 2;
+    int render_iterations = 100;
     bool show_help = false;
     std::string css_file = "./cloth-notifications/resources/style.css";
 
-    Gtk::Main gtk_main;
+    /// Set by `init_gtk()`
+    std::optional<Gtk::Main> gtk_main;
+    Glib::RefPtr<Glib::MainLoop> main_loop;
 
     Glib::RefPtr<Gdk::Display> gdk_display;
-    wl::display_t display;
+    /// Set by `init_ui()`. Empty until then, so nothing connects to the
+    /// compositor before the first notification in lazy mode
+    std::optional<wl::display_t> display;
     wl::registry_t registry;
     wl::zwlr_layer_shell_v1_t layer_shell;
     wl::output_t output;
-    DBus::BusDispatcher dispatcher;
-    std::thread dbus_thread;
+
+    std::unique_ptr<NotificationServer> server;
+    std::unique_ptr<TraceReplay> replay;
 
     Glib::RefPtr<Gtk::StyleContext> style_context;
     Glib::RefPtr<Gtk::CssProvider> css_provider;
 
-    Client(int argc, char* argv[])
-      : gtk_main(argc, argv),
-        gdk_display(Gdk::Display::get_default()),
-        display(gdk_wayland_display_get_wl_display(gdk_display->gobj())),
-        style_context(Gtk::StyleContext::create()),
-        css_provider(Gtk::CssProvider::create())
+    Client(int argc, char* argv[]) : _argc(argc), _argv(argv) {}
+
+    /// Initialize GTK and load the CSS, if that has not been done yet
+    auto init_gtk() -> void;
+
+    /// Initialize GTK and connect to the compositor, if that has not been
+    /// done yet
+    auto init_ui() -> void;
+
+    /// Whether `init_ui()` has been called
+    auto has_ui() const noexcept -> bool
     {
-      if (!css_provider->load_from_path(css_file)) {
-        cloth_error("Error loading CSS file");
-      }
+      return display.has_value();
     }
 
-    auto dbus_main() -> void;
+    /// Stop the main loop, returning from `main()`
+    auto quit() -> void;
 
     auto bind_interfaces();
 
@@ -65,11 +97,85 @@ namespace cloth::notifications {
                    ("Bar Height")
                  | Opt(css_file, "css_file")
                    ["--css"]
-                   ("Path to css file");
+                   ("Path to css file")
+                 | Opt(max_visible, "max_visible")
+                   ["--max-visible"]
+                   ("Maximum number of notifications shown at once")
+                 | Opt(single_surface)
+                   ["--single-surface"]
+                   ("Draw all notifications on one surface, instead of a surface per notification")
+                 | Opt(coalesce_ms, "milliseconds")
+                   ["--coalesce"]
+                   ("Merge notifications from one application that arrive within this long of "
+                    "each other into one. 0 to disable")
+                 | Opt(lazy)
+                   ["--lazy"]
+                   ("Only initialize GTK and connect to the compositor on the first notification. "
+                    "For D-Bus activation")
+                 | Opt(exit_idle_s, "seconds")
+                   ["--exit-idle"]
+                   ("Exit after no notifications have been shown for this long. 0 to never exit")
+                 | Opt(trim_idle_s, "seconds")
+                   ["--trim-idle"]
+                   ("Release pooled windows and cached images back to the system after no "
+                    "notifications have been shown for this long. 0 to never release them")
+                 | Opt(record_file, "file")
+                   ["--record"]
+                   ("Record all Notify and CloseNotification calls to this trace file")
+                 | Opt(replay_file, "file")
+                   ["--replay"]
+                   ("Replay the calls in a trace file recorded with --record, then exit. "
+                    "Runs next to the server on the bus, and keeps no history")
+                 | Opt(replay_speed, "factor")
+                   ["--replay-speed"]
+                   ("Speed of --replay relative to the recording. 0 for as fast as possible")
+                 | Opt(render_png, "file.png")
+                   ["--render"]
+                   ("Render a notification offscreen without a compositor, write it to this file, "
+                    "and report the time taken by each step. Needs a GDK backend other than "
+                    "wayland, like GDK_BACKEND=x11 with Xvfb")
+                 | Opt(render_summary, "text")
+                   ["--render-summary"]
+                   ("Summary of the notification rendered with --render, may contain markup")
+                 | Opt(render_body, "text")
+                   ["--render-body"]
+                   ("Body of the notification rendered with --render")
+                 | Opt(render_image, "path|icon")
+                   ["--render-image"]
+                   ("Image of the notification rendered with --render")
+                 | Opt(render_actions, "count")
+                   ["--render-actions"]
+                   ("Number of actions of the notification rendered with --render")
+                 | Opt(render_iterations, "count")
+                   ["--render-iterations"]
+                   ("Number of times to render the notification with --render")
+                 | Opt(image_budget_mb, "MiB")
+                   ["--image-budget"]
+                   ("Memory for notification images, before images of queued notifications "
+                    "are shrunk and cached images evicted")
+                 | Opt(rate_low, "per_second")
+                   ["--rate-low"]
+                   ("Low urgency notifications each sender may send per second. 0 for no limit")
+                 | Opt(rate_normal, "per_second")
+                   ["--rate-normal"]
+                   ("Normal urgency notifications each sender may send per second. 0 for no limit")
+                 | Opt(rate_burst, "count")
+                   ["--rate-burst"]
+                   ("Notifications a sender may send at once before being rate limited")
+                 | Opt(rate_key, "sender|app")
+                   ["--rate-key"]
+                   ("Rate limit per D-Bus sender, or per application name")
+                 | Opt(rate_drop)
+                   ["--rate-drop"]
+                   ("Reject notifications over the rate limit, instead of delaying them");
       // clang-format on
       return cli;
     }
 
     int main(int argc, char* argv[]);
+
+  private:
+    int _argc;
+    char** _argv;
   };
 } // namespace cloth::notifications
@@ -0,0 +1,267 @@
+#include "downscale.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define CLOTH_DOWNSCALE_X86 1
+#endif
+
+namespace cloth::notifications {
+
+  namespace {
+
+    /// The source pixels covering one destination pixel along one axis.
+    ///
+    /// Weights are normalized so they sum to 1 over the span. Only the first
+    /// and last pixel can be partially covered.
+    struct Span {
+      int first = 0;
+      int count = 0;
+      float first_weight = 0;
+      float weight = 0;
+      float last_weight = 0;
+    };
+
+    auto make_spans(int src, int dst) -> std::vector<Span>
+    {
+      std::vector<Span> spans(dst);
+      double scale = double(src) / dst;
+      double norm = 1 / scale;
+      for (int i = 0; i < dst; i++) {
+        double start = i * scale;
+        double end = std::min((i + 1) * scale, double(src));
+        int first = std::min(int(start), src - 1);
+        int last = std::clamp(int(std::ceil(end)) - 1, first, src - 1);
+        auto& span = spans[i];
+        span.first = first;
+        span.count = last - first + 1;
+        span.weight = float(norm);
+        if (first == last) {
+          span.first_weight = span.last_weight = float((end - start) * norm);
+        } else {
+          span.first_weight = float((first + 1 - start) * norm);
+          span.last_weight = float((end - last) * norm);
+        }
+      }
+      return spans;
+    }
+
+    /// Reduces one source row horizontally, into 4 premultiplied floats per
+    /// destination pixel
+    using ReduceRow = void (*)(const uint8_t* row,
+                               int channels,
+                               const std::vector<Span>& spans,
+                               float* out);
+
+    inline auto load_scalar(const uint8_t* px, int channels, float* out) -> void
+    {
+      float a = channels == 4 ? px[3] : 255.f;
+      float f = a * (1 / 255.f);
+      out[0] = px[0] * f;
+      out[1] = px[1] * f;
+      out[2] = px[2] * f;
+      out[3] = a;
+    }
+
+    auto reduce_row_scalar(const uint8_t* row,
+                           int channels,
+                           const std::vector<Span>& spans,
+                           float* out) -> void
+    {
+      for (auto& span : spans) {
+        float acc[4] = {0, 0, 0, 0};
+        float px[4];
+        const uint8_t* p = row + span.first * channels;
+        for (int k = 0; k < span.count; k++, p += channels) {
+          float w = k == 0 ? span.first_weight : k == span.count - 1 ? span.last_weight : span.weight;
+          load_scalar(p, channels, px);
+          for (int c = 0; c < 4; c++) acc[c] += w * px[c];
+        }
+        std::memcpy(out, acc, sizeof(acc));
+        out += 4;
+      }
+    }
+
+#ifdef CLOTH_DOWNSCALE_X86
+
+    inline auto load_sse2(const uint8_t* px, int channels) -> __m128
+    {
+      int32_t bits;
+      if (channels == 4) {
+        std::memcpy(&bits, px, 4);
+      } else {
+        bits = int32_t(px[0] | (px[1] << 8) | (px[2] << 16) | (0xffu << 24));
+      }
+      auto zero = _mm_setzero_si128();
+      auto v = _mm_cvtsi32_si128(bits);
+      v = _mm_unpacklo_epi8(v, zero);
+      v = _mm_unpacklo_epi16(v, zero);
+      auto f = _mm_cvtepi32_ps(v);
+      // Multiply the color channels by alpha / 255, and alpha by 1
+      auto alpha = _mm_shuffle_ps(f, f, _MM_SHUFFLE(3, 3, 3, 3));
+      auto rgb_mask = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+      auto factor = _mm_or_ps(_mm_and_ps(_mm_mul_ps(alpha, _mm_set1_ps(1 / 255.f)), rgb_mask),
+                              _mm_set_ps(1, 0, 0, 0));
+      return _mm_mul_ps(f, factor);
+    }
+
+    auto reduce_row_sse2(const uint8_t* row,
+                         int channels,
+                         const std::vector<Span>& spans,
+                         float* out) -> void
+    {
+      for (auto& span : spans) {
+        const uint8_t* p = row + span.first * channels;
+        auto acc = _mm_mul_ps(load_sse2(p, channels), _mm_set1_ps(span.first_weight));
+        if (span.count > 1) {
+          auto inner = _mm_setzero_ps();
+          p += channels;
+          for (int k = 1; k < span.count - 1; k++, p += channels) {
+            inner = _mm_add_ps(inner, load_sse2(p, channels));
+          }
+          acc = _mm_add_ps(acc, _mm_mul_ps(inner, _mm_set1_ps(span.weight)));
+          acc = _mm_add_ps(acc, _mm_mul_ps(load_sse2(p, channels), _mm_set1_ps(span.last_weight)));
+        }
+        _mm_storeu_ps(out, acc);
+        out += 4;
+      }
+    }
+
+    __attribute__((target("avx2"))) auto reduce_row_avx2(const uint8_t* row,
+                                                         int channels,
+                                                         const std::vector<Span>& spans,
+                                                         float* out) -> void
+    {
+      // Only RGBA pixels are loaded in pairs, RGB rows use the SSE2 path
+      if (channels != 4) return reduce_row_sse2(row, channels, spans, out);
+
+      auto rgb_mask = _mm256_castsi256_ps(_mm256_set_epi32(0, -1, -1, -1, 0, -1, -1, -1));
+      auto alpha_one = _mm256_set_ps(1, 0, 0, 0, 1, 0, 0, 0);
+      auto inv_255 = _mm256_set1_ps(1 / 255.f);
+
+      for (auto& span : spans) {
+        const uint8_t* p = row + span.first * 4;
+        auto acc = _mm_mul_ps(load_sse2(p, 4), _mm_set1_ps(span.first_weight));
+        if (span.count > 1) {
+          p += 4;
+          int inner_count = span.count - 2;
+          auto inner2 = _mm256_setzero_ps();
+          int k = 0;
+          for (; k + 1 < inner_count; k += 2, p += 8) {
+            auto f = _mm256_cvtepi32_ps(
+              _mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i*>(p))));
+            auto alpha = _mm256_permute_ps(f, _MM_SHUFFLE(3, 3, 3, 3));
+            auto factor =
+              _mm256_or_ps(_mm256_and_ps(_mm256_mul_ps(alpha, inv_255), rgb_mask), alpha_one);
+            inner2 = _mm256_add_ps(inner2, _mm256_mul_ps(f, factor));
+          }
+          auto inner =
+            _mm_add_ps(_mm256_castps256_ps128(inner2), _mm256_extractf128_ps(inner2, 1));
+          for (; k < inner_count; k++, p += 4) {
+            inner = _mm_add_ps(inner, load_sse2(p, 4));
+          }
+          acc = _mm_add_ps(acc, _mm_mul_ps(inner, _mm_set1_ps(span.weight)));
+          acc = _mm_add_ps(acc, _mm_mul_ps(load_sse2(p, 4), _mm_set1_ps(span.last_weight)));
+        }
+        _mm_storeu_ps(out, acc);
+        out += 4;
+      }
+    }
+
+#endif
+
+    auto reduce_row_for(detail::SimdLevel level) -> ReduceRow
+    {
+      switch (level) {
+#ifdef CLOTH_DOWNSCALE_X86
+      case detail::SimdLevel::AVX2: return reduce_row_avx2;
+      case detail::SimdLevel::SSE2: return reduce_row_sse2;
+#endif
+      default: return reduce_row_scalar;
+      }
+    }
+
+    inline auto to_byte(float v) -> uint8_t
+    {
+      return uint8_t(std::clamp(v + 0.5f, 0.f, 255.f));
+    }
+
+  } // namespace
+
+  namespace detail {
+
+    auto downscale_simd_level() noexcept -> SimdLevel
+    {
+#ifdef CLOTH_DOWNSCALE_X86
+      static const SimdLevel level = [] {
+        if (__builtin_cpu_supports("avx2")) return SimdLevel::AVX2;
+        if (__builtin_cpu_supports("sse2")) return SimdLevel::SSE2;
+        return SimdLevel::Scalar;
+      }();
+      return level;
+#else
+      return SimdLevel::Scalar;
+#endif
+    }
+
+    auto downscale_area(SimdLevel level,
+                        const uint8_t* src,
+                        int src_width,
+                        int src_height,
+                        int src_stride,
+                        uint8_t* dst,
+                        int dst_width,
+                        int dst_height,
+                        int dst_stride,
+                        int channels) -> void
+    {
+      if (dst_width <= 0 || dst_height <= 0) return;
+      auto reduce_row = reduce_row_for(level);
+      auto xspans = make_spans(src_width, dst_width);
+      auto yspans = make_spans(src_height, dst_height);
+
+      std::vector<float> row(dst_width * 4);
+      std::vector<float> acc(dst_width * 4);
+      for (int y = 0; y < dst_height; y++) {
+        auto& span = yspans[y];
+        std::fill(acc.begin(), acc.end(), 0.f);
+        for (int k = 0; k < span.count; k++) {
+          float w = k == 0 ? span.first_weight : k == span.count - 1 ? span.last_weight : span.weight;
+          reduce_row(src + std::size_t(span.first + k) * src_stride, channels, xspans, row.data());
+          for (std::size_t i = 0; i < acc.size(); i++) acc[i] += w * row[i];
+        }
+
+        uint8_t* out = dst + std::size_t(y) * dst_stride;
+        for (int x = 0; x < dst_width; x++, out += channels) {
+          const float* px = acc.data() + x * 4;
+          float alpha = px[3];
+          float unpremultiply = alpha > 0 ? 255 / alpha : 0;
+          out[0] = to_byte(px[0] * unpremultiply);
+          out[1] = to_byte(px[1] * unpremultiply);
+          out[2] = to_byte(px[2] * unpremultiply);
+          if (channels == 4) out[3] = to_byte(alpha);
+        }
+      }
+    }
+
+  } // namespace detail
+
+  auto downscale_area(const uint8_t* src,
+                      int src_width,
+                      int src_height,
+                      int src_stride,
+                      uint8_t* dst,
+                      int dst_width,
+                      int dst_height,
+                      int dst_stride,
+                      int channels) -> void
+  {
+    detail::downscale_area(detail::downscale_simd_level(), src, src_width, src_height, src_stride,
+                           dst, dst_width, dst_height, dst_stride, channels);
+  }
+
+} // namespace cloth::notifications
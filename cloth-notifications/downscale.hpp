@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+
+namespace cloth::notifications {
+
+  /// Downscale an 8 bit RGB or RGBA image by area averaging.
+  ///
+  /// Every destination pixel is the average of the source area it covers,
+  /// weighted by fractional coverage at the edges. RGBA pixels are
+  /// premultiplied while averaging, so fully transparent pixels don't bleed
+  /// their color into the result.
+  ///
+  /// Uses AVX2 or SSE2 where available, with a scalar fallback.
+  ///
+  /// \param channels 3 for RGB, 4 for RGBA. Same for source and destination
+  /// \pre `dst_width <= src_width` and `dst_height <= src_height`
+  auto downscale_area(const uint8_t* src,
+                      int src_width,
+                      int src_height,
+                      int src_stride,
+                      uint8_t* dst,
+                      int dst_width,
+                      int dst_height,
+                      int dst_stride,
+                      int channels) -> void;
+
+  namespace detail {
+    enum struct SimdLevel { Scalar, SSE2, AVX2 };
+
+    /// The implementation used by `downscale_area` on this CPU
+    auto downscale_simd_level() noexcept -> SimdLevel;
+
+    /// `downscale_area` with a fixed implementation, for comparing them
+    auto downscale_area(SimdLevel level,
+                        const uint8_t* src,
+                        int src_width,
+                        int src_height,
+                        int src_stride,
+                        uint8_t* dst,
+                        int dst_width,
+                        int dst_height,
+                        int dst_stride,
+                        int channels) -> void;
+  } // namespace detail
+
+} // namespace cloth::notifications
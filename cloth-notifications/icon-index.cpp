@@ -0,0 +1,51 @@
+#include "icon-index.hpp"
+
+#include "util/algorithm.hpp"
+#include "util/logging.hpp"
+
+namespace cloth::notifications {
+
+  IconIndex::IconIndex(int size) : _size(size) {}
+
+  IconIndex::~IconIndex()
+  {
+    _theme_changed.disconnect();
+  }
+
+  auto IconIndex::theme() -> const Glib::RefPtr<Gtk::IconTheme>&
+  {
+    if (!_theme) {
+      _theme = Gtk::IconTheme::get_default();
+      _theme_changed = _theme->signal_changed().connect([this] { clear(); });
+    }
+    return _theme;
+  }
+
+  auto IconIndex::is_path(const std::string& icon) noexcept -> bool
+  {
+    return util::starts_with("/", icon) || util::starts_with("file://", icon);
+  }
+
+  auto IconIndex::lookup(const std::string& name) -> const std::string&
+  {
+    auto found = _resolved.find(name);
+    if (found != _resolved.end()) return found->second;
+
+    std::string file;
+    if (auto info = theme()->lookup_icon(name, _size)) file = info.get_filename();
+    if (file.empty()) cloth_debug("No icon named {} in the icon theme", name);
+    return _resolved.emplace(name, std::move(file)).first->second;
+  }
+
+  auto IconIndex::prewarm() -> void
+  {
+    // The theme and its caches are loaded on the first lookup
+    theme()->has_icon("dialog-information");
+  }
+
+  auto IconIndex::clear() -> void
+  {
+    _resolved.clear();
+  }
+
+} // namespace cloth::notifications
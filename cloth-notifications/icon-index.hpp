@@ -0,0 +1,57 @@
+#pragma once
+
+#include <string>
+#include <unordered_map>
+
+#include <gtkmm.h>
+
+namespace cloth::notifications {
+
+  /// Resolves themed icon names, like the `app_icon` of most notifications,
+  /// to the file to load at one size.
+  ///
+  /// The lookup itself is done by the default `Gtk::IconTheme`, which reads
+  /// the `icon-theme.cache` of each theme directory, and rescans directories
+  /// whose mtime changed. Results are kept in memory by name, including names
+  /// that are not in the theme, so repeated notifications don't go through the
+  /// theme, or touch the filesystem, at all. They are dropped when the theme
+  /// changes.
+  ///
+  /// Not thread safe, use from the GTK main loop.
+  struct IconIndex {
+    /// \param size The size in pixels to find icons for
+    IconIndex(int size);
+    IconIndex(const IconIndex&) = delete;
+    ~IconIndex();
+
+    /// Whether `icon` is a path or `file://` URI rather than an icon name
+    static auto is_path(const std::string& icon) noexcept -> bool;
+
+    /// The file of the icon named `name`, or an empty string if the theme
+    /// has no such icon
+    auto lookup(const std::string& name) -> const std::string&;
+
+    /// Load the icon theme, so the first lookup doesn't have to
+    auto prewarm() -> void;
+
+    /// Forget all resolved names
+    auto clear() -> void;
+
+    auto size() const noexcept -> std::size_t
+    {
+      return _resolved.size();
+    }
+
+  private:
+    /// The default icon theme, looked up on first use, so the index can be
+    /// created before GTK is initialized
+    auto theme() -> const Glib::RefPtr<Gtk::IconTheme>&;
+
+    int _size;
+    Glib::RefPtr<Gtk::IconTheme> _theme;
+    sigc::connection _theme_changed;
+    /// Icon name to file, empty for names that are not in the theme
+    std::unordered_map<std::string, std::string> _resolved;
+  };
+
+} // namespace cloth::notifications
@@ -0,0 +1,73 @@
+#include "image-cache.hpp"
+
+namespace cloth::notifications {
+
+  auto ImageCache::get(const std::string& key) -> Glib::RefPtr<Gdk::Pixbuf>
+  {
+    auto lock = std::unique_lock(_mutex);
+    auto found = _index.find(key);
+    if (found == _index.end()) {
+      _stats.misses++;
+      return {};
+    }
+    _stats.hits++;
+    _lru.splice(_lru.begin(), _lru, found->second);
+    return found->second->second;
+  }
+
+  auto ImageCache::put(const std::string& key, Glib::RefPtr<Gdk::Pixbuf> pixbuf) -> void
+  {
+    if (!pixbuf) return;
+    auto size = byte_size(pixbuf);
+    if (size > _max_bytes) return;
+    auto lock = std::unique_lock(_mutex);
+    auto found = _index.find(key);
+    if (found != _index.end()) {
+      _stats.bytes -= byte_size(found->second->second);
+      _lru.erase(found->second);
+      _index.erase(found);
+    }
+    _lru.emplace_front(key, std::move(pixbuf));
+    _index[key] = _lru.begin();
+    _stats.bytes += size;
+    evict(_max_bytes);
+  }
+
+  auto ImageCache::clear() -> void
+  {
+    auto lock = std::unique_lock(_mutex);
+    _lru.clear();
+    _index.clear();
+    _stats.bytes = 0;
+  }
+
+  auto ImageCache::trim(std::size_t max_bytes) -> void
+  {
+    auto lock = std::unique_lock(_mutex);
+    evict(max_bytes);
+  }
+
+  auto ImageCache::stats() -> Stats
+  {
+    auto lock = std::unique_lock(_mutex);
+    auto res = _stats;
+    res.entries = _lru.size();
+    return res;
+  }
+
+  auto ImageCache::byte_size(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) -> std::size_t
+  {
+    return pixbuf->get_byte_length();
+  }
+
+  auto ImageCache::evict(std::size_t max_bytes) -> void
+  {
+    while (_stats.bytes > max_bytes && !_lru.empty()) {
+      auto& [key, pixbuf] = _lru.back();
+      _stats.bytes -= byte_size(pixbuf);
+      _index.erase(key);
+      _lru.pop_back();
+    }
+  }
+
+} // namespace cloth::notifications
@@ -0,0 +1,62 @@
+#pragma once
+
+#include <list>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+#include <gtkmm.h>
+
+namespace cloth::notifications {
+
+  /// A size bounded LRU cache of decoded and scaled images.
+  ///
+  /// Thread safe. Cached pixbufs are shared, and must not be modified.
+  struct ImageCache {
+    struct Stats {
+      std::size_t hits = 0;
+      std::size_t misses = 0;
+      std::size_t entries = 0;
+      std::size_t bytes = 0;
+    };
+
+    /// \param max_bytes Total size of the cached pixel data
+    ImageCache(std::size_t max_bytes = 8 << 20) : _max_bytes(max_bytes) {}
+    ImageCache(const ImageCache&) = delete;
+
+    /// Look up `key`, and mark it as recently used.
+    ///
+    /// \returns an empty pointer on a miss
+    auto get(const std::string& key) -> Glib::RefPtr<Gdk::Pixbuf>;
+
+    /// Insert or replace `key`, evicting the least recently used entries
+    /// until the cache fits in its size limit again.
+    auto put(const std::string& key, Glib::RefPtr<Gdk::Pixbuf> pixbuf) -> void;
+
+    auto clear() -> void;
+
+    /// Evict the least recently used entries until the cache uses at most
+    /// `max_bytes`
+    auto trim(std::size_t max_bytes) -> void;
+
+    auto stats() -> Stats;
+
+    /// The amount of memory used by the pixel data of `pixbuf`
+    static auto byte_size(const Glib::RefPtr<Gdk::Pixbuf>& pixbuf) -> std::size_t;
+
+  private:
+    using Entry = std::pair<std::string, Glib::RefPtr<Gdk::Pixbuf>>;
+
+    /// Evict entries until at most `max_bytes` are used. Called with the
+    /// mutex held
+    auto evict(std::size_t max_bytes) -> void;
+
+    std::size_t _max_bytes;
+    std::mutex _mutex;
+    /// Most recently used first
+    std::list<Entry> _lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> _index;
+    Stats _stats;
+  };
+
+} // namespace cloth::notifications
@@ -0,0 +1,199 @@
+#include "image-loader.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <string_view>
+
+#include <sys/stat.h>
+
+#include "util/algorithm.hpp"
+#include "util/logging.hpp"
+
+#include "downscale.hpp"
+
+namespace cloth::notifications {
+
+  namespace {
+    /// Scale down using the area averaging downscaler, falling back to
+    /// gdk-pixbuf for formats it does not handle
+    auto scale_down(const Glib::RefPtr<Gdk::Pixbuf>& src, int width, int height)
+      -> Glib::RefPtr<Gdk::Pixbuf>
+    {
+      auto channels = src->get_n_channels();
+      if (src->get_colorspace() != Gdk::COLORSPACE_RGB || src->get_bits_per_sample() != 8 ||
+          channels != (src->get_has_alpha() ? 4 : 3)) {
+        return src->scale_simple(width, height, Gdk::InterpType::INTERP_BILINEAR);
+      }
+      auto dst = Gdk::Pixbuf::create(Gdk::COLORSPACE_RGB, src->get_has_alpha(), 8, width, height);
+      downscale_area(src->get_pixels(), src->get_width(), src->get_height(), src->get_rowstride(),
+                     dst->get_pixels(), width, height, dst->get_rowstride(), channels);
+      return dst;
+    }
+  } // namespace
+
+  auto RawImage::valid() const noexcept -> bool
+  {
+    if (!pixels || width <= 0 || height <= 0) return false;
+    if (bits_per_sample != 8) return false;
+    if (channels != (has_alpha ? 4 : 3)) return false;
+    if (rowstride < width * channels) return false;
+    auto needed = std::size_t(rowstride) * (height - 1) + std::size_t(width) * channels;
+    return size >= needed;
+  }
+
+  auto RawImage::to_pixbuf() const -> Glib::RefPtr<Gdk::Pixbuf>
+  {
+    using Pixels = std::shared_ptr<const uint8_t>;
+    auto* ref = new Pixels(pixels);
+    auto* pixbuf = gdk_pixbuf_new_from_data(
+      pixels.get(), GDK_COLORSPACE_RGB, has_alpha, bits_per_sample, width, height, rowstride,
+      [](guchar*, gpointer data) { delete static_cast<Pixels*>(data); }, ref);
+    return Glib::wrap(pixbuf);
+  }
+
+  auto ImageSource::identity() const -> std::string
+  {
+    if (auto* path = std::get_if<std::string>(&data)) return *path;
+    if (auto* raw = std::get_if<RawImage>(&data); raw && raw->pixels) {
+      return fmt::format("data:{}:{}:{}x{}:{}:{}:{}:{}",
+                         static_cast<const void*>(raw->pixels.get()), raw->size, raw->width,
+                         raw->height, raw->rowstride, raw->has_alpha, raw->bits_per_sample,
+                         raw->channels);
+    }
+    if (auto* pixbuf = std::get_if<Glib::RefPtr<Gdk::Pixbuf>>(&data); pixbuf && *pixbuf) {
+      return fmt::format("pixbuf:{}", static_cast<const void*>(pixbuf->get()));
+    }
+    return {};
+  }
+
+  auto ImageSource::byte_size() const -> std::size_t
+  {
+    if (auto* raw = std::get_if<RawImage>(&data)) return raw->pixels ? raw->size : 0;
+    if (auto* pixbuf = std::get_if<Glib::RefPtr<Gdk::Pixbuf>>(&data); pixbuf && *pixbuf) {
+      return ImageCache::byte_size(*pixbuf);
+    }
+    return 0;
+  }
+
+  ImageLoader::ImageLoader(std::size_t threads, std::size_t max_queued)
+    : _thread_count(threads), _max_queued(max_queued)
+  {}
+
+  ImageLoader::~ImageLoader()
+  {
+    {
+      auto lock = std::unique_lock(_mutex);
+      _running = false;
+    }
+    _condvar.notify_all();
+    for (auto& thread : _threads) {
+      if (thread.joinable()) thread.join();
+    }
+  }
+
+  auto ImageLoader::load(ImageSource source,
+                         int max_width,
+                         int max_height,
+                         Callback callback,
+                         Priority priority) -> void
+  {
+    std::optional<Job> dropped;
+    {
+      auto lock = std::unique_lock(_mutex);
+      if (_threads.empty()) {
+        for (std::size_t i = 0; i < _thread_count; i++) {
+          _threads.emplace_back(&ImageLoader::worker, this);
+        }
+      }
+      auto& queue = priority == Priority::Display ? _queue : _background;
+      if (queue.size() >= _max_queued) {
+        dropped = std::move(queue.front());
+        queue.pop_front();
+      }
+      queue.push_back({std::move(source), max_width, max_height, std::move(callback)});
+    }
+    _condvar.notify_one();
+    if (dropped) {
+      cloth_error("Image queue full, dropping image");
+      finish(std::move(dropped->callback), {});
+    }
+  }
+
+  auto ImageLoader::worker() -> void
+  {
+    while (true) {
+      auto lock = std::unique_lock(_mutex);
+      _condvar.wait(lock, [this] { return !_running || !_queue.empty() || !_background.empty(); });
+      if (!_running) return;
+      auto& queue = _queue.empty() ? _background : _queue;
+      auto job = std::move(queue.front());
+      queue.pop_front();
+      lock.unlock();
+
+      auto key = cache_key(job.source, job.max_width, job.max_height);
+      auto pixbuf = key.empty() ? Glib::RefPtr<Gdk::Pixbuf>() : cache.get(key);
+      if (!pixbuf) {
+        pixbuf = decode(job.source, job.max_width, job.max_height);
+        if (!key.empty()) cache.put(key, pixbuf);
+      }
+      finish(std::move(job.callback), std::move(pixbuf));
+    }
+  }
+
+  auto ImageLoader::finish(Callback callback, Glib::RefPtr<Gdk::Pixbuf> pixbuf) -> void
+  {
+    Glib::signal_idle().connect_once([callback = std::move(callback), pixbuf = std::move(pixbuf)] {
+      callback(pixbuf);
+    });
+  }
+
+  auto ImageLoader::cache_key(const ImageSource& source, int max_width, int max_height)
+    -> std::string
+  {
+    if (auto* path = std::get_if<std::string>(&source.data)) {
+      auto file = util::starts_with("file://", *path) ? path->substr(7) : *path;
+      struct stat st;
+      if (::stat(file.c_str(), &st) != 0) return {};
+      return fmt::format("file:{}:{}.{}:{}x{}", file, st.st_mtim.tv_sec, st.st_mtim.tv_nsec,
+                         max_width, max_height);
+    } else if (auto* raw = std::get_if<RawImage>(&source.data)) {
+      if (!raw->pixels) return {};
+      // Hashes the whole buffer, so only computed on the worker threads
+      auto hash = std::hash<std::string_view>()(
+        std::string_view(reinterpret_cast<const char*>(raw->pixels.get()), raw->size));
+      return fmt::format("data:{:016x}:{}x{}:{}:{}:{}:{}:{}x{}", hash, raw->width, raw->height,
+                         raw->rowstride, raw->has_alpha, raw->bits_per_sample, raw->channels,
+                         max_width, max_height);
+    }
+    return {};
+  }
+
+  auto ImageLoader::decode(ImageSource& source, int max_width, int max_height)
+    -> Glib::RefPtr<Gdk::Pixbuf>
+  {
+    Glib::RefPtr<Gdk::Pixbuf> pixbuf;
+    try {
+      if (auto* path = std::get_if<std::string>(&source.data)) {
+        auto file = util::starts_with("file://", *path) ? path->substr(7) : *path;
+        pixbuf = Gdk::Pixbuf::create_from_file(file);
+      } else if (auto* raw = std::get_if<RawImage>(&source.data)) {
+        if (raw->valid()) pixbuf = raw->to_pixbuf();
+      } else if (auto* decoded = std::get_if<Glib::RefPtr<Gdk::Pixbuf>>(&source.data)) {
+        pixbuf = *decoded;
+      }
+    } catch (Glib::Error& e) {
+      cloth_error("Error loading image: {}", e.what().c_str());
+      return {};
+    }
+    if (!pixbuf) return {};
+
+    auto w = pixbuf->get_width();
+    auto h = pixbuf->get_height();
+    if (w > max_width || h > max_height) {
+      auto scale = std::min(max_width / float(w), max_height / float(h));
+      return scale_down(pixbuf, std::max(1, int(w * scale)), std::max(1, int(h * scale)));
+    }
+    return pixbuf;
+  }
+
+} // namespace cloth::notifications
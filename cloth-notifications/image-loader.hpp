@@ -0,0 +1,139 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <variant>
+#include <vector>
+
+#include <gtkmm.h>
+
+#include "image-cache.hpp"
+
+namespace cloth::notifications {
+
+  /// Raw pixel data, as sent in the `image-data` hint
+  struct RawImage {
+    int width = 0;
+    int height = 0;
+    int rowstride = 0;
+    bool has_alpha = false;
+    int bits_per_sample = 8;
+    int channels = 3;
+    /// Shared between all copies of the image, and any pixbuf created from it.
+    ///
+    /// Usually points into the D-Bus message the image was received in, and
+    /// keeps that alive
+    std::shared_ptr<const uint8_t> pixels;
+    /// Size of the pixel buffer in bytes
+    std::size_t size = 0;
+
+    /// Check that the image has a format gdk-pixbuf supports, and that the
+    /// pixel buffer is large enough for the given dimensions.
+    auto valid() const noexcept -> bool;
+
+    /// Wrap the pixels in a pixbuf without copying them.
+    ///
+    /// The pixbuf keeps a reference to the pixel buffer
+    auto to_pixbuf() const -> Glib::RefPtr<Gdk::Pixbuf>;
+  };
+
+  /// Where to load a notification image from.
+  ///
+  /// Cheap to build from the notification hints, the actual decoding is done
+  /// by the `ImageLoader`
+  struct ImageSource {
+    /// Nothing, a file path, raw pixel data, or an image that was already
+    /// decoded and scaled, to keep less memory around than the raw data
+    std::variant<std::monostate, std::string, RawImage, Glib::RefPtr<Gdk::Pixbuf>> data;
+    bool is_icon = false;
+
+    auto empty() const noexcept -> bool
+    {
+      return std::holds_alternative<std::monostate>(data);
+    }
+
+    /// A string that is equal for sources of the same image: the path, or the
+    /// address of the raw image buffer and its layout. Empty if there is no
+    /// image.
+    ///
+    /// Cheap enough for the main loop, the pixels are not read. A buffer
+    /// allocated at the address of a freed one has the same identity, see
+    /// `Notification::populate()`
+    auto identity() const -> std::string;
+
+    /// The memory held by the image data
+    auto byte_size() const -> std::size_t;
+  };
+
+  /// A bounded pool of worker threads, decoding and scaling notification images.
+  ///
+  /// The threads are started by the first `load()`.
+  struct ImageLoader {
+    using Callback = std::function<void(Glib::RefPtr<Gdk::Pixbuf>)>;
+
+    enum struct Priority {
+      /// Images of notifications that are about to be shown
+      Display,
+      /// Only taken by the workers when no display jobs are pending
+      Background,
+    };
+
+    /// \param threads Number of worker threads
+    /// \param max_queued Number of pending jobs of each priority. When a
+    ///        queue is full, its oldest job is dropped.
+    ImageLoader(std::size_t threads = 2, std::size_t max_queued = 16);
+    ImageLoader(const ImageLoader&) = delete;
+    ~ImageLoader();
+
+    /// Decode `source` on a worker thread, and scale it down to fit inside
+    /// `max_width`x`max_height`.
+    ///
+    /// `callback` is called on the GTK main loop, with an empty pointer if the
+    /// image could not be loaded, or the job was dropped.
+    auto load(ImageSource source,
+              int max_width,
+              int max_height,
+              Callback callback,
+              Priority priority = Priority::Display) -> void;
+
+    /// Decode and scale an image on the calling thread
+    static auto decode(ImageSource& source, int max_width, int max_height)
+      -> Glib::RefPtr<Gdk::Pixbuf>;
+
+    /// The cache key of a scaled image.
+    ///
+    /// Files are keyed on their path and modification time, raw image data on
+    /// a hash of its contents. Returns an empty string if the source can not be
+    /// cached.
+    static auto cache_key(const ImageSource& source, int max_width, int max_height) -> std::string;
+
+    /// Decoded images, already scaled to fit their requested size
+    ImageCache cache;
+
+  private:
+    struct Job {
+      ImageSource source;
+      int max_width;
+      int max_height;
+      Callback callback;
+    };
+
+    auto worker() -> void;
+    static auto finish(Callback callback, Glib::RefPtr<Gdk::Pixbuf> pixbuf) -> void;
+
+    std::size_t _thread_count;
+    std::size_t _max_queued;
+    std::deque<Job> _queue;
+    std::deque<Job> _background;
+    std::mutex _mutex;
+    std::condition_variable _condvar;
+    bool _running = true;
+    std::vector<std::thread> _threads;
+  };
+
+} // namespace cloth::notifications
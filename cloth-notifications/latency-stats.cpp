@@ -0,0 +1,111 @@
+#include "latency-stats.hpp"
+
+#include <algorithm>
+#include <cmath>
+
+#include <fmt/format.h>
+
+namespace cloth::notifications {
+
+  auto LatencyHistogram::bucket_index(uint64_t value) noexcept -> std::size_t
+  {
+    value = std::min(value, (uint64_t(1) << max_value_bits) - 1);
+    // The first two octaves are recorded exactly
+    if (value < 2 * sub_bucket_half) return value;
+    int msb = 63 - __builtin_clzll(value);
+    int shift = msb - sub_bucket_bits;
+    return (shift + 1) * sub_bucket_half + (value >> shift) - sub_bucket_half;
+  }
+
+  auto LatencyHistogram::bucket_max(std::size_t index) noexcept -> uint64_t
+  {
+    if (index < 2 * sub_bucket_half) return index;
+    auto shift = index / sub_bucket_half - 1;
+    auto sub_bucket = index % sub_bucket_half + sub_bucket_half;
+    return ((sub_bucket + 1) << shift) - 1;
+  }
+
+  auto LatencyHistogram::record(duration value) noexcept -> void
+  {
+    auto us = uint64_t(std::max<duration::rep>(value.count(), 0));
+    _buckets[bucket_index(us)]++;
+    _count++;
+    _sum += us;
+    _min = std::min(_min, us);
+    _max = std::max(_max, us);
+  }
+
+  auto LatencyHistogram::min() const noexcept -> duration
+  {
+    return duration(_count ? _min : 0);
+  }
+
+  auto LatencyHistogram::max() const noexcept -> duration
+  {
+    return duration(_max);
+  }
+
+  auto LatencyHistogram::mean() const noexcept -> duration
+  {
+    return duration(_count ? _sum / _count : 0);
+  }
+
+  auto LatencyHistogram::percentile(double quantile) const noexcept -> duration
+  {
+    if (_count == 0) return duration(0);
+    auto rank = uint64_t(std::ceil(std::clamp(quantile, 0.0, 1.0) * _count));
+    rank = std::max<uint64_t>(rank, 1);
+    uint64_t seen = 0;
+    for (std::size_t i = 0; i < bucket_count; i++) {
+      seen += _buckets[i];
+      if (seen >= rank) return duration(std::clamp(bucket_max(i), _min, _max));
+    }
+    return duration(_max);
+  }
+
+  auto LatencyHistogram::reset() noexcept -> void
+  {
+    *this = LatencyHistogram();
+  }
+
+  auto LatencyStats::record(LatencyStage stage, clock::duration duration) noexcept -> void
+  {
+    _stages[std::size_t(stage)].record(
+      std::chrono::duration_cast<LatencyHistogram::duration>(duration));
+  }
+
+  auto LatencyStats::reset() noexcept -> void
+  {
+    for (auto& histogram : _stages) histogram.reset();
+  }
+
+  auto LatencyStats::name(LatencyStage stage) noexcept -> const char*
+  {
+    switch (stage) {
+    case LatencyStage::Receipt: return "receipt";
+    case LatencyStage::Decode: return "decode";
+    case LatencyStage::Build: return "build";
+    case LatencyStage::Configure: return "configure";
+    case LatencyStage::FirstFrame: return "first_frame";
+    case LatencyStage::Total: return "total";
+    }
+    return "unknown";
+  }
+
+  auto LatencyStats::report() const -> std::string
+  {
+    auto ms = [](LatencyHistogram::duration d) { return d.count() / 1000.0; };
+    std::string res = fmt::format("{:<12} {:>8} {:>9} {:>9} {:>9} {:>9} {:>9} {:>9}\n", "stage",
+                                  "count", "min ms", "mean ms", "p50 ms", "p90 ms", "p99 ms",
+                                  "max ms");
+    for (std::size_t i = 0; i < latency_stage_count; i++) {
+      auto& h = _stages[i];
+      res += fmt::format("{:<12} {:>8} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f}\n",
+                         name(LatencyStage(i)), h.count(), ms(h.min()), ms(h.mean()),
+                         ms(h.percentile(0.5)), ms(h.percentile(0.9)), ms(h.percentile(0.99)),
+                         ms(h.max()));
+    }
+    return res;
+  }
+
+} // namespace cloth::notifications
@@ -0,0 +1,105 @@
+#pragma once
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+namespace cloth::notifications {
+
+  /// A histogram of durations with bounded relative error, in the style of
+  /// HdrHistogram.
+  ///
+  /// Values are recorded in microseconds, in logarithmic buckets with 32
+  /// linear sub-buckets per power of two. Every value is reported to within
+  /// about 3%, recording is constant time, and the size of the histogram does
+  /// not depend on the number of samples.
+  struct LatencyHistogram {
+    using duration = std::chrono::microseconds;
+
+    auto record(duration value) noexcept -> void;
+
+    auto count() const noexcept -> uint64_t
+    {
+      return _count;
+    }
+
+    auto min() const noexcept -> duration;
+    auto max() const noexcept -> duration;
+    auto mean() const noexcept -> duration;
+
+    /// The smallest recorded value that `quantile` of all samples are less
+    /// than or equal to, rounded up to its bucket.
+    ///
+    /// \param quantile Between 0 and 1
+    auto percentile(double quantile) const noexcept -> duration;
+
+    auto reset() noexcept -> void;
+
+  private:
+    static constexpr int sub_bucket_bits = 5;
+    static constexpr uint64_t sub_bucket_half = uint64_t(1) << sub_bucket_bits;
+    /// Values are clamped to 2^36 us, a little over 19 hours
+    static constexpr int max_value_bits = 36;
+    static constexpr std::size_t bucket_count =
+      (max_value_bits - sub_bucket_bits + 1) * sub_bucket_half;
+
+    static auto bucket_index(uint64_t value) noexcept -> std::size_t;
+    /// The largest value that falls in bucket `index`
+    static auto bucket_max(std::size_t index) noexcept -> uint64_t;
+
+    std::array<uint64_t, bucket_count> _buckets = {};
+    uint64_t _count = 0;
+    uint64_t _sum = 0;
+    uint64_t _min = UINT64_MAX;
+    uint64_t _max = 0;
+  };
+
+  /// The stages between a `Notify` call and the notification becoming visible
+  enum struct LatencyStage {
+    /// Parsing the D-Bus message and its hints
+    Receipt,
+    /// Decoding and scaling the image, including time spent queued
+    Decode,
+    /// Populating the widgets of the notification window
+    Build,
+    /// From mapping the layer surface until the compositor configures it
+    Configure,
+    /// From the configure event until the window is first drawn
+    FirstFrame,
+    /// From receipt of the `Notify` call until the window is first drawn
+    Total,
+  };
+
+  constexpr std::size_t latency_stage_count = std::size_t(LatencyStage::Total) + 1;
+
+  /// One latency histogram per stage
+  struct LatencyStats {
+    using clock = std::chrono::steady_clock;
+
+    auto record(LatencyStage stage, clock::duration duration) noexcept -> void;
+
+    /// Record the time since `since`
+    auto record_since(LatencyStage stage, clock::time_point since) noexcept -> void
+    {
+      record(stage, clock::now() - since);
+    }
+
+    auto operator[](LatencyStage stage) const noexcept -> const LatencyHistogram&
+    {
+      return _stages[std::size_t(stage)];
+    }
+
+    auto reset() noexcept -> void;
+
+    /// A short name for `stage`, like `first_frame`
+    static auto name(LatencyStage stage) noexcept -> const char*;
+
+    /// A human readable table of all stages, one line per stage
+    auto report() const -> std::string;
+
+  private:
+    std::array<LatencyHistogram, latency_stage_count> _stages;
+  };
+
+} // namespace cloth::notifications
@@ -0,0 +1,194 @@
+#include "notification-history.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "util/logging.hpp"
+
+namespace cloth::notifications {
+
+  namespace fs = std::filesystem;
+
+  struct NotificationHistory::Header {
+    static constexpr char expected_magic[8] = {'C', 'L', 'O', 'T', 'H', 'N', 'H', '1'};
+
+    char magic[8];
+    uint32_t record_size;
+    uint32_t reserved;
+    uint64_t capacity;
+    /// `seq` of the last appended entry
+    uint64_t last_seq;
+  };
+
+  /// One entry. `seq` is written last, and is 0 while the record is being
+  /// written, so a torn write is never read back as a valid entry
+  struct NotificationHistory::Record {
+    uint64_t seq;
+    int64_t timestamp;
+    uint32_t id;
+    uint8_t urgency;
+    uint8_t reserved[3];
+    char app_name[64];
+    char summary[256];
+    char body[1024];
+    char image[256];
+  };
+
+  namespace {
+    /// Copy `src` into a fixed-size field, truncating on a UTF-8 character
+    /// boundary and padding with zeroes
+    template<std::size_t N>
+    auto write_field(char (&dst)[N], const std::string& src) -> void
+    {
+      auto len = std::min(src.size(), N - 1);
+      if (len < src.size()) {
+        while (len > 0 && (uint8_t(src[len]) & 0xc0) == 0x80) len--;
+      }
+      std::memcpy(dst, src.data(), len);
+      std::memset(dst + len, 0, N - len);
+    }
+
+    template<std::size_t N>
+    auto read_field(const char (&src)[N]) -> std::string
+    {
+      return std::string(src, strnlen(src, N));
+    }
+  } // namespace
+
+  NotificationHistory::NotificationHistory(std::string path, std::size_t capacity)
+    : _path(std::move(path)), _capacity(capacity)
+  {
+    _size = sizeof(Header) + sizeof(Record) * _capacity;
+    std::error_code ec;
+    fs::create_directories(fs::path(_path).parent_path(), ec);
+    int fd = ::open(_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+    if (fd < 0) {
+      cloth_error("Could not open notification history {}: {}", _path, std::strerror(errno));
+      return;
+    }
+
+    // Only the header is checked, the records validate themselves
+    Header header = {};
+    bool valid = ::pread(fd, &header, sizeof(header), 0) == sizeof(header) &&
+                 std::memcmp(header.magic, Header::expected_magic, sizeof(header.magic)) == 0 &&
+                 header.record_size == sizeof(Record) && header.capacity == _capacity &&
+                 ::lseek(fd, 0, SEEK_END) == off_t(_size);
+    if (!valid) {
+      cloth_info("Creating notification history {}", _path);
+      if (::ftruncate(fd, 0) != 0 || ::ftruncate(fd, _size) != 0) {
+        cloth_error("Could not resize notification history {}: {}", _path, std::strerror(errno));
+        ::close(fd);
+        return;
+      }
+    }
+
+    // Populate the mapping up front, so appends don't fault pages in from disk
+    void* map = ::mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, 0);
+    ::close(fd);
+    if (map == MAP_FAILED) {
+      cloth_error("Could not map notification history {}: {}", _path, std::strerror(errno));
+      return;
+    }
+    _header = static_cast<Header*>(map);
+    _records = reinterpret_cast<Record*>(static_cast<char*>(map) + sizeof(Header));
+    if (!valid) {
+      std::memcpy(_header->magic, Header::expected_magic, sizeof(_header->magic));
+      _header->record_size = sizeof(Record);
+      _header->capacity = _capacity;
+      _header->last_seq = 0;
+      ::msync(_header, sizeof(Header), MS_ASYNC);
+    }
+  }
+
+  NotificationHistory::~NotificationHistory()
+  {
+    if (_header) ::munmap(_header, _size);
+  }
+
+  auto NotificationHistory::default_path() -> std::string
+  {
+    if (auto* state = std::getenv("XDG_STATE_HOME"); state && *state) {
+      return fs::path(state) / "cloth-notifications" / "history";
+    }
+    if (auto* home = std::getenv("HOME"); home && *home) {
+      return fs::path(home) / ".local" / "state" / "cloth-notifications" / "history";
+    }
+    if (auto* runtime = std::getenv("XDG_RUNTIME_DIR"); runtime && *runtime) {
+      return fs::path(runtime) / "cloth-notifications-history";
+    }
+    return {};
+  }
+
+  auto NotificationHistory::record(uint64_t seq) const noexcept -> Record*
+  {
+    return &_records[(seq - 1) % _capacity];
+  }
+
+  auto NotificationHistory::append(const HistoryEntry& entry) -> void
+  {
+    if (!_header) return;
+    auto seq = _header->last_seq + 1;
+    auto& rec = *record(seq);
+
+    rec.seq = 0;
+    std::atomic_thread_fence(std::memory_order_release);
+    rec.timestamp = entry.timestamp;
+    rec.id = entry.id;
+    rec.urgency = entry.urgency;
+    write_field(rec.app_name, entry.app_name);
+    write_field(rec.summary, entry.summary);
+    write_field(rec.body, entry.body);
+    write_field(rec.image, entry.image);
+    std::atomic_thread_fence(std::memory_order_release);
+    rec.seq = seq;
+    _header->last_seq = seq;
+
+    // Schedule writeback of the touched pages, without waiting for it
+    static const auto page_size = uintptr_t(::sysconf(_SC_PAGESIZE));
+    auto flush = [](const void* begin, std::size_t size) {
+      auto first = reinterpret_cast<uintptr_t>(begin) & ~(page_size - 1);
+      auto last = reinterpret_cast<uintptr_t>(begin) + size;
+      ::msync(reinterpret_cast<void*>(first), last - first, MS_ASYNC);
+    };
+    flush(&rec, sizeof(Record));
+    flush(_header, sizeof(Header));
+  }
+
+  auto NotificationHistory::query(const HistoryQuery& query) const -> std::vector<HistoryEntry>
+  {
+    std::vector<HistoryEntry> res;
+    if (!_header) return res;
+    auto last = _header->last_seq;
+    if (query.before != 0) last = std::min(last, query.before - 1);
+    auto first = _header->last_seq >= _capacity ? _header->last_seq - _capacity + 1 : 1;
+
+    for (auto seq = last; seq >= first && seq > 0 && res.size() < query.limit; seq--) {
+      auto& rec = *record(seq);
+      if (rec.seq != seq) continue;
+      if (query.since != 0 && rec.timestamp < query.since) continue;
+      if (query.until != 0 && rec.timestamp >= query.until) continue;
+      if (!query.app_name.empty() &&
+          strncmp(rec.app_name, query.app_name.c_str(), sizeof(rec.app_name)) != 0)
+        continue;
+      HistoryEntry entry;
+      entry.seq = rec.seq;
+      entry.id = rec.id;
+      entry.timestamp = rec.timestamp;
+      entry.urgency = rec.urgency;
+      entry.app_name = read_field(rec.app_name);
+      entry.summary = read_field(rec.summary);
+      entry.body = read_field(rec.body);
+      entry.image = read_field(rec.image);
+      res.push_back(std::move(entry));
+    }
+    return res;
+  }
+
+} // namespace cloth::notifications
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace cloth::notifications {
+
+  /// A notification, as stored in the history
+  struct HistoryEntry {
+    /// Position in the history, starting at 1. Increases with every entry
+    uint64_t seq = 0;
+    /// The notification id the entry was shown with
+    uint32_t id = 0;
+    /// Microseconds since the unix epoch
+    int64_t timestamp = 0;
+    uint8_t urgency = 1;
+    std::string app_name;
+    std::string summary;
+    std::string body;
+    /// Path of the image or icon, if it was sent as one
+    std::string image;
+  };
+
+  /// Filters for `NotificationHistory::query`
+  struct HistoryQuery {
+    /// Only entries at or after this timestamp. 0 for no limit
+    int64_t since = 0;
+    /// Only entries before this timestamp. 0 for no limit
+    int64_t until = 0;
+    /// Only entries from this application. Empty for all
+    std::string app_name;
+    /// Only entries with a lower `seq`, to continue from the last entry of
+    /// the previous page. 0 to start from the newest entry
+    uint64_t before = 0;
+    std::size_t limit = 50;
+  };
+
+  /// A persistent history of notifications, in a fixed-size memory mapped
+  /// ring of fixed-size records.
+  ///
+  /// Appending is a copy into the mapping, followed by a non-blocking
+  /// `msync(MS_ASYNC)`. Opening the file only validates its header, so the
+  /// history is available right away, and queries are answered from the
+  /// mapping without copying it into memory first.
+  ///
+  /// Strings longer than their record field are truncated.
+  struct NotificationHistory {
+    /// Number of entries kept before the oldest are overwritten
+    static constexpr std::size_t default_capacity = 1024;
+
+    /// Map the history file at `path`, creating it if needed. A file with
+    /// another layout or capacity is reset.
+    NotificationHistory(std::string path, std::size_t capacity = default_capacity);
+    NotificationHistory(const NotificationHistory&) = delete;
+    ~NotificationHistory();
+
+    /// `$XDG_STATE_HOME/cloth-notifications/history`, falling back to
+    /// `~/.local/state`, and then to `$XDG_RUNTIME_DIR`
+    static auto default_path() -> std::string;
+
+    /// Whether the file was mapped. If not, appends are dropped and queries
+    /// return nothing
+    auto is_open() const noexcept -> bool
+    {
+      return _header != nullptr;
+    }
+
+    auto append(const HistoryEntry& entry) -> void;
+
+    /// Entries matching `query`, newest first
+    auto query(const HistoryQuery& query) const -> std::vector<HistoryEntry>;
+
+  private:
+    struct Header;
+    struct Record;
+
+    auto record(uint64_t seq) const noexcept -> Record*;
+
+    std::string _path;
+    std::size_t _capacity;
+    std::size_t _size = 0;
+    Header* _header = nullptr;
+    Record* _records = nullptr;
+  };
+
+} // namespace cloth::notifications
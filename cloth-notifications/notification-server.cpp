@@ -2,137 +2,1095 @@
 
 #include "client.hpp"
 
+#include <algorithm>
+#include <csignal>
+#include <fstream>
+
+#include <glib-unix.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+
+#include <cloth-notifications-xml.hpp>
+#include <dbus-notifications-xml.hpp>
+
 #include "gdkwayland.hpp"
 #include "util/iterators.hpp"
 
 namespace cloth::notifications {
 
-  auto get_image(const std::map<std::string, ::DBus::Variant>& hints, const std::string& app_icon)
-    -> std::pair<Glib::RefPtr<Gdk::Pixbuf>, bool>
+  namespace {
+    /// Look up a hint, returning an empty variant if it is missing
+    auto lookup_hint(GVariant* hints, const char* key) -> Glib::VariantBase
+    {
+      return Glib::VariantBase(g_variant_lookup_value(hints, key, nullptr));
+    }
+
+    auto parse_urgency(GVariant* hints) -> Urgency
+    {
+      auto urg = lookup_hint(hints, "urgency");
+      if (!urg) return Urgency::Normal;
+      auto* v = urg.gobj();
+      int64_t value;
+      switch (g_variant_classify(v)) {
+      case G_VARIANT_CLASS_BYTE: value = g_variant_get_byte(v); break;
+      case G_VARIANT_CLASS_UINT32: value = g_variant_get_uint32(v); break;
+      case G_VARIANT_CLASS_INT32: value = g_variant_get_int32(v); break;
+      default:
+        cloth_error("Urgency hint has wrong type {}", urg.get_type_string());
+        return Urgency::Normal;
+      }
+      // Anything else would get past the rate limits, and never expire
+      if (value < int64_t(Urgency::Low) || value > int64_t(Urgency::Critical)) {
+        cloth_error("Invalid urgency {}", value);
+        return Urgency::Normal;
+      }
+      return Urgency(value);
+    }
+
+    auto hint_string(const Glib::VariantBase& hint) -> std::string
+    {
+      if (!hint.is_of_type(Glib::VARIANT_TYPE_STRING)) return {};
+      return g_variant_get_string(const_cast<GVariant*>(hint.gobj()), nullptr);
+    }
+
+    /// The `value` hint, clamped to 0-100, or -1 if it is missing
+    auto parse_value(GVariant* hints) -> int
+    {
+      auto hint = lookup_hint(hints, "value");
+      if (!hint) return -1;
+      auto* v = hint.gobj();
+      switch (g_variant_classify(v)) {
+      case G_VARIANT_CLASS_INT32: return std::clamp(g_variant_get_int32(v), 0, 100);
+      case G_VARIANT_CLASS_UINT32: return int(std::min(g_variant_get_uint32(v), 100u));
+      default:
+        cloth_error("Value hint has wrong type {}", hint.get_type_string());
+        return -1;
+      }
+    }
+
+    /// The `(app_name, urgency, min_age)` arguments of the bulk vendor methods
+    auto parse_filter(const Glib::VariantContainerBase& parameters) -> NotificationFilter
+    {
+      const gchar* app_name;
+      gint32 urgency;
+      guint64 min_age;
+      g_variant_get(const_cast<GVariant*>(parameters.gobj()), "(&sit)", &app_name, &urgency,
+                    &min_age);
+      NotificationFilter res;
+      res.app_name = app_name;
+      if (urgency >= 0) res.urgency = Urgency(urgency);
+      res.min_age = std::chrono::microseconds(min_age);
+      return res;
+    }
+
+    auto id_array(const std::vector<uint32_t>& ids) -> Glib::VariantBase
+    {
+      return Glib::VariantBase(g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, ids.data(),
+                                                         ids.size(), sizeof(uint32_t)));
+    }
+
+    /// Resident set size of the process in bytes, from /proc/self/statm
+    auto resident_bytes() -> std::size_t
+    {
+      std::ifstream statm("/proc/self/statm");
+      std::size_t size = 0, resident = 0;
+      if (!(statm >> size >> resident)) return 0;
+      return resident * std::size_t(::sysconf(_SC_PAGESIZE));
+    }
+
+    /// The tag of notifications replacing each other, like volume OSDs
+    auto synchronous_tag(GVariant* hints) -> std::string
+    {
+      for (auto* name : {"x-canonical-private-synchronous", "x-dunst-stack-tag"}) {
+        if (auto hint = lookup_hint(hints, name)) return hint_string(hint);
+      }
+      return {};
+    }
+  } // namespace
+
+  auto get_image_source(GVariant* hints, const std::string& app_icon, IconIndex& icons)
+    -> ImageSource
+  {
+    // Paths are passed on as they are, anything else is an icon name
+    auto resolve = [&](const std::string& icon) -> std::string {
+      if (icon.empty() || IconIndex::is_path(icon)) return icon;
+      return icons.lookup(icon);
+    };
+    auto [key, is_path, is_icon] = [&]() -> std::tuple<std::string, bool, bool> {
+      for (auto* name : {"image-data", "image_data"}) { // image_data is deprecated
+        if (lookup_hint(hints, name)) return {name, false, false};
+      }
+      for (auto* name : {"image-path", "image_path"}) { // image_path is deprecated
+        if (auto hint = lookup_hint(hints, name)) return {resolve(hint_string(hint)), true, false};
+      }
+      if (auto file = resolve(app_icon); !file.empty()) return {file, true, true};
+      if (lookup_hint(hints, "icon_data")) return {"icon_data", false, true};
+      return {"", true, false};
+    }();
+
+    ImageSource res;
+    res.is_icon = is_icon;
+    if (key.empty()) return res;
+    if (is_path) {
+      res.data = key;
+      return res;
+    }
+    auto hint = lookup_hint(hints, key.c_str());
+    if (!hint.is_of_type(Glib::VariantType("(iiibiiay)"))) {
+      cloth_error("{} hint has wrong type {}", key, hint.get_type_string());
+      return res;
+    }
+    gint32 width, height, rowstride, bits_per_sample, channels;
+    gboolean has_alpha;
+    GVariant* image_data;
+    g_variant_get(hint.gobj(), "(iiibii@ay)", &width, &height, &rowstride, &has_alpha,
+                  &bits_per_sample, &channels, &image_data);
+    cloth_debug("Image data: {}, {}, {}, {}, {}, {}", width, height, rowstride, has_alpha,
+                bits_per_sample, channels);
+    // The pixels are not copied out of the message. The byte array points
+    // into its serialized data, and holds a reference to it for as long as
+    // the image source, or any pixbuf created from it, is alive
+    gsize size = 0;
+    auto* bytes = static_cast<const uint8_t*>(g_variant_get_fixed_array(image_data, &size, 1));
+    RawImage raw;
+    raw.width = width;
+    raw.height = height;
+    raw.rowstride = rowstride;
+    raw.has_alpha = has_alpha;
+    raw.bits_per_sample = bits_per_sample;
+    raw.channels = channels;
+    auto owner = std::shared_ptr<GVariant>(image_data, g_variant_unref);
+    raw.pixels = std::shared_ptr<const uint8_t>(owner, bytes);
+    raw.size = size;
+    if (!raw.valid()) {
+      cloth_error("Invalid {} hint: {}x{}, rowstride {}, {} bits per sample, {} channels, {} bytes",
+                  key, width, height, rowstride, bits_per_sample, channels, raw.size);
+      return res;
+    }
+    res.data = std::move(raw);
+    return res;
+  }
+
+  NotificationServer::NotificationServer(Client& client)
+    : client(client),
+      _vtable(sigc::mem_fun(*this, &NotificationServer::on_method_call)),
+      _vendor_vtable(sigc::mem_fun(*this, &NotificationServer::on_vendor_method_call))
+  {
+    _owner_id = Gio::DBus::own_name(
+      Gio::DBus::BUS_TYPE_SESSION, server_name,
+      sigc::mem_fun(*this, &NotificationServer::on_bus_acquired), {},
+      [](const Glib::RefPtr<Gio::DBus::Connection>&, const Glib::ustring& name) {
+        cloth_error("Could not acquire notification server name {}", name.raw());
+      });
+
+    if (!client.record_file.empty()) {
+      trace = std::make_unique<TraceWriter>(client.record_file);
+      if (!trace->is_open()) trace.reset();
+    }
+
+    init();
+  }
+
+  NotificationServer::NotificationServer(Client& client, Offscreen)
+    : client(client),
+      _vtable(sigc::mem_fun(*this, &NotificationServer::on_method_call)),
+      _vendor_vtable(sigc::mem_fun(*this, &NotificationServer::on_vendor_method_call)),
+      _offscreen(true)
+  {}
+
+  NotificationServer::NotificationServer(Client& client, Replay)
+    : client(client),
+      _vtable(sigc::mem_fun(*this, &NotificationServer::on_method_call)),
+      _vendor_vtable(sigc::mem_fun(*this, &NotificationServer::on_vendor_method_call)),
+      _history_path(fmt::format("{}/cloth-notifications-replay-{}", Glib::get_tmp_dir(),
+                                ::getpid())),
+      _history_temporary(true)
+  {
+    init();
+  }
+
+  auto NotificationServer::init() -> void
   {
+    _sigusr1_source = g_unix_signal_add(
+      SIGUSR1,
+      [](gpointer data) -> gboolean {
+        auto& server = *static_cast<NotificationServer*>(data);
+        cloth_info("Notification latency:\n{}", server.latency.report());
+        cloth_info("Rate limited: {} queued, {} dropped, {} pending",
+                   server.rate_limit_stats.queued, server.rate_limit_stats.dropped,
+                   server.rate_limit_pending());
+        return G_SOURCE_CONTINUE;
+      },
+      this);
+
+    if (client.has_ui()) start_ui();
+    update_idle();
+  }
+
+  auto NotificationServer::start_ui() -> void
+  {
+    if (_ui_started) return;
+    _ui_started = true;
+    client.init_ui();
+    if (client.single_surface) stack_surface = std::make_unique<StackSurface>(*this);
+
+    Glib::signal_idle().connect_once([this] {
+      icons.prewarm();
+      while (pool.size() < prewarm_pool_size) {
+        pool.push_back(std::make_unique<Notification>(*this));
+      }
+    });
+  }
+
+  auto NotificationServer::is_idle() const -> bool
+  {
+    return notifications.empty() && overflow.empty() && _rate_queues.empty();
+  }
+
+  auto NotificationServer::update_idle() -> void
+  {
+    if (!notifications.empty() || !overflow.empty()) {
+      _idle_timer.disconnect();
+      _trim_timer.disconnect();
+      return;
+    }
+    if (client.exit_idle_s > 0 && !_idle_timer.connected()) {
+      _idle_timer = Glib::signal_timeout().connect_seconds(
+        [this] {
+          // Calls held back by the rate limits will still be shown
+          if (is_idle()) {
+            cloth_info("No notifications for {}s, exiting", client.exit_idle_s);
+            client.quit();
+          }
+          return false;
+        },
+        client.exit_idle_s);
+    }
+    // Keep the prewarmed pool until the first notification
+    if (client.trim_idle_s > 0 && _id != 0 && !_trim_timer.connected()) {
+      _trim_timer = Glib::signal_timeout().connect_seconds(
+        [this] {
+          if (is_idle()) release_memory();
+          return false;
+        },
+        client.trim_idle_s);
+    }
+  }
+
+  auto NotificationServer::release_memory() -> void
+  {
+    trim_stats.rss_before = resident_bytes();
+    pool.clear();
+    image_loader.cache.clear();
+    icons.clear();
+#ifdef __GLIBC__
+    malloc_trim(0);
+#endif
+    trim_stats.rss_after = resident_bytes();
+    trim_stats.count++;
+    cloth_info("Released memory while idle, RSS {} KiB -> {} KiB", trim_stats.rss_before >> 10,
+               trim_stats.rss_after >> 10);
+  }
+
+  NotificationServer::~NotificationServer()
+  {
+    _idle_timer.disconnect();
+    for (auto& [key, queue] : _rate_queues) queue.timer.disconnect();
+    if (_sigusr1_source) g_source_remove(_sigusr1_source);
+    for (auto id : _registration_ids) _connection->unregister_object(id);
+    if (_owner_id) Gio::DBus::unown_name(_owner_id);
+  }
+
+  auto NotificationServer::on_bus_acquired(const Glib::RefPtr<Gio::DBus::Connection>& connection,
+                                           const Glib::ustring& name) -> void
+  {
+    static const auto node_info = Gio::DBus::NodeInfo::create_for_xml(dbus_notifications_xml);
+    static const auto vendor_node_info =
+      Gio::DBus::NodeInfo::create_for_xml(cloth_notifications_xml);
     try {
-      auto [key, is_path, is_icon] = [&]() -> std::tuple<std::string, bool, bool> {
-        if (hints.count("image-data")) return {"image-data", false, false};
-        if (hints.count("image_data")) return {"image_data", false, false}; // deprecated
-        if (hints.count("image-path")) return {hints.at("image-path"), true, false};
-        if (hints.count("image_path")) return {hints.at("image_path"), true, false}; // deprecated
-        if (!app_icon.empty()) return {app_icon, true, true};
-        if (hints.count("icon_data")) return {"icon_data", false, true};
-        return {"", true, false};
-      }();
-
-      if (is_path && !key.empty()) {
-        if (util::starts_with("file://", key)) key = key.substr(7);
-        return std::pair(Gdk::Pixbuf::create_from_file(key), is_icon);
-      } else if (!key.empty()) {
-        auto [width, height, rowstride, has_alpha, bits_per_sample, channels, image_data, _] =
-          DBus::Struct<int, int, int, bool, int, int, std::vector<uint8_t>>(hints.at("image-data"));
-        cloth_debug("Image data: {}, {}, {}, {}, {}, {}", width, height, rowstride, has_alpha,
-                    bits_per_sample, channels);
-        return std::pair(
-          Gdk::Pixbuf::create_from_data(image_data.data(), Gdk::Colorspace::COLORSPACE_RGB,
-                                        has_alpha, bits_per_sample, width, height, rowstride),
-          is_icon);
+      _connection = connection;
+      _registration_ids.push_back(connection->register_object(
+        server_path, node_info->lookup_interface(server_interface), _vtable));
+      _registration_ids.push_back(connection->register_object(
+        server_path, vendor_node_info->lookup_interface(vendor_interface), _vendor_vtable));
+    } catch (const Glib::Error& e) {
+      cloth_error("Could not register {}: {}", server_path, e.what().raw());
+    }
+  }
+
+  auto NotificationServer::on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& connection,
+                                          const Glib::ustring& sender,
+                                          const Glib::ustring& object_path,
+                                          const Glib::ustring& interface_name,
+                                          const Glib::ustring& method_name,
+                                          const Glib::VariantContainerBase& parameters,
+                                          const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation)
+    -> void
+  {
+    // GDBus has already checked the arguments against the introspection data
+    auto* params = const_cast<GVariant*>(parameters.gobj());
+    auto string = [](auto&& str) { return Glib::Variant<Glib::ustring>::create(str); };
+    try {
+      if (method_name == "Notify") {
+        if (admit_notify(sender, parameters, invocation)) {
+          handle_notify(sender, parameters, invocation);
+        }
+      } else if (method_name == "CloseNotification") {
+        guint32 id;
+        g_variant_get(params, "(u)", &id);
+        if (trace) trace->write(TraceCall::CloseNotification, params, id);
+        CloseNotification(id);
+        invocation->return_value({});
+      } else if (method_name == "GetCapabilities") {
+        std::vector<Glib::ustring> caps;
+        for (auto& cap : GetCapabilities()) caps.emplace_back(cap);
+        invocation->return_value(Glib::VariantContainerBase::create_tuple(
+          Glib::Variant<std::vector<Glib::ustring>>::create(caps)));
+      } else if (method_name == "GetServerInformation") {
+        std::string name, vendor, version, spec_version;
+        GetServerInformation(name, vendor, version, spec_version);
+        invocation->return_value(Glib::VariantContainerBase::create_tuple(
+          {string(name), string(vendor), string(version), string(spec_version)}));
+      } else {
+        invocation->return_error(
+          Gio::DBus::Error(Gio::DBus::Error::UNKNOWN_METHOD, "Unknown method " + method_name));
       }
+    } catch (std::exception& e) {
+      cloth_error("NotificationServer::{}: {}", method_name.raw(), e.what());
+      invocation->return_error(Gio::DBus::Error(Gio::DBus::Error::FAILED, e.what()));
+    }
+  }
 
-    } catch (Glib::FileError& e) {
-      cloth_error("FileError: {}", e.what());
+  auto NotificationServer::handle_notify(
+    const Glib::ustring& sender,
+    const Glib::VariantContainerBase& parameters,
+    const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation) -> void
+  {
+    try {
+      cloth_debug("Notify from {}", sender.raw());
+      auto* params = const_cast<GVariant*>(parameters.gobj());
+      auto id = notify(params);
+      if (trace) trace->write(TraceCall::Notify, params, id);
+      invocation->return_value(
+        Glib::VariantContainerBase::create_tuple(Glib::Variant<guint32>::create(id)));
+    } catch (std::exception& e) {
+      cloth_error("NotificationServer::Notify: {}", e.what());
+      invocation->return_error(Gio::DBus::Error(Gio::DBus::Error::FAILED, e.what()));
     }
-    return std::pair(Glib::RefPtr<Gdk::Pixbuf>{}, false);
   }
 
-  auto NotificationServer::GetCapabilities(DBus::Error& e) -> std::vector<std::string>
+  auto NotificationServer::notify(GVariant* parameters) -> uint32_t
+  {
+    const gchar *app_name, *app_icon, *summary, *body;
+    guint32 replaces_id;
+    const gchar** actions_array;
+    GVariant* hints;
+    gint32 expire_timeout;
+    g_variant_get(parameters, "(&su&s&s&s^a&s@a{sv}i)", &app_name, &replaces_id, &app_icon,
+                  &summary, &body, &actions_array, &hints, &expire_timeout);
+    std::vector<std::string> actions;
+    for (auto* action = actions_array; *action; action++) actions.emplace_back(*action);
+    g_free(actions_array);
+    auto hints_ref = Glib::VariantBase(hints);
+    return Notify(app_name, replaces_id, app_icon, summary, body, actions, hints, expire_timeout);
+  }
+
+  auto NotificationServer::rate_limit(Urgency urgency) const -> RateLimiter::Rate
+  {
+    switch (urgency) {
+    case Urgency::Low: return {client.rate_low, client.rate_burst};
+    case Urgency::Normal: return {client.rate_normal, client.rate_burst};
+    // Critical notifications are always admitted
+    case Urgency::Critical: return {};
+    }
+    return {};
+  }
+
+  auto NotificationServer::admit_notify(
+    const Glib::ustring& sender,
+    const Glib::VariantContainerBase& parameters,
+    const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation) -> bool
+  {
+    auto* params = const_cast<GVariant*>(parameters.gobj());
+    auto* hints = g_variant_get_child_value(params, 6);
+    auto urgency = parse_urgency(hints);
+    g_variant_unref(hints);
+    auto rate = rate_limit(urgency);
+    if (rate.unlimited()) return true;
+
+    std::string key;
+    if (client.rate_key == "app") {
+      const gchar* app_name;
+      g_variant_get_child(params, 0, "&s", &app_name);
+      key = app_name;
+    } else {
+      key = sender;
+    }
+    key += ':';
+    key += char('0' + static_cast<int>(urgency));
+
+    // Calls already waiting for this bucket go first
+    auto queued = _rate_queues.find(key);
+    bool backlog = queued != _rate_queues.end() && !queued->second.pending.empty();
+    if (!backlog && rate_limiter.try_acquire(key, rate)) return true;
+
+    if (!client.rate_drop) {
+      auto& queue = _rate_queues[key];
+      if (queue.pending.size() < max_rate_queue) {
+        queue.rate = rate;
+        queue.pending.push_back({sender, parameters, invocation});
+        rate_limit_stats.queued++;
+        if (!queue.timer.connected()) schedule_rate_drain(key);
+        return false;
+      }
+    }
+    rate_limit_stats.dropped++;
+    cloth_debug("Rate limited Notify from {}", key);
+    invocation->return_error(
+      Gio::DBus::Error(Gio::DBus::Error::LIMITS_EXCEEDED, "Notification rate limit exceeded"));
+    return false;
+  }
+
+  auto NotificationServer::schedule_rate_drain(const std::string& key) -> void
+  {
+    auto& queue = _rate_queues.at(key);
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+      rate_limiter.time_until_token(key, queue.rate));
+    queue.timer = Glib::signal_timeout().connect(
+      [this, key] {
+        drain_rate_queue(key);
+        return false;
+      },
+      std::max<long>(wait.count(), 1));
+  }
+
+  auto NotificationServer::drain_rate_queue(const std::string& key) -> void
+  {
+    auto found = _rate_queues.find(key);
+    if (found == _rate_queues.end()) return;
+    auto& queue = found->second;
+    while (!queue.pending.empty() && rate_limiter.try_acquire(key, queue.rate)) {
+      auto pending = std::move(queue.pending.front());
+      queue.pending.pop_front();
+      handle_notify(pending.sender, pending.parameters, pending.invocation);
+    }
+    if (queue.pending.empty()) {
+      _rate_queues.erase(found);
+    } else {
+      schedule_rate_drain(key);
+    }
+  }
+
+  auto NotificationServer::on_vendor_method_call(
+    const Glib::RefPtr<Gio::DBus::Connection>& connection,
+    const Glib::ustring& sender,
+    const Glib::ustring& object_path,
+    const Glib::ustring& interface_name,
+    const Glib::ustring& method_name,
+    const Glib::VariantContainerBase& parameters,
+    const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation) -> void
+  {
+    if (method_name == "GetLatencyStats") {
+      invocation->return_value(Glib::VariantContainerBase::create_tuple(GetLatencyStats()));
+    } else if (method_name == "ResetLatencyStats") {
+      ResetLatencyStats();
+      invocation->return_value({});
+    } else if (method_name == "GetStats") {
+      invocation->return_value(Glib::VariantContainerBase::create_tuple(GetStats()));
+    } else if (method_name == "ListNotifications") {
+      auto list = ListNotifications(parse_filter(parameters));
+      invocation->return_value(Glib::VariantContainerBase::create_tuple(list));
+    } else if (method_name == "CloseMatching") {
+      auto closed = CloseMatching(parse_filter(parameters));
+      invocation->return_value(Glib::VariantContainerBase::create_tuple(id_array(closed)));
+    } else if (method_name == "CloseNotifications") {
+      auto* array = g_variant_get_child_value(const_cast<GVariant*>(parameters.gobj()), 0);
+      gsize n = 0;
+      auto* data =
+        static_cast<const uint32_t*>(g_variant_get_fixed_array(array, &n, sizeof(uint32_t)));
+      std::vector<uint32_t> ids(data, data + n);
+      g_variant_unref(array);
+      auto closed = CloseNotifications(ids);
+      invocation->return_value(Glib::VariantContainerBase::create_tuple(id_array(closed)));
+    } else if (method_name == "GetHistory") {
+      HistoryQuery query;
+      const gchar* app_name;
+      guint32 limit;
+      g_variant_get(const_cast<GVariant*>(parameters.gobj()), "(xx&stu)", &query.since,
+                    &query.until, &app_name, &query.before, &limit);
+      query.app_name = app_name;
+      query.limit = limit;
+      invocation->return_value(Glib::VariantContainerBase::create_tuple(GetHistory(query)));
+    } else {
+      invocation->return_error(
+        Gio::DBus::Error(Gio::DBus::Error::UNKNOWN_METHOD, "Unknown method " + method_name));
+    }
+  }
+
+  auto NotificationServer::NotificationClosed(uint32_t id, uint32_t reason) -> void
+  {
+    if (!_connection) return;
+    _connection->emit_signal(server_path, server_interface, "NotificationClosed", {},
+                             Glib::VariantContainerBase::create_tuple(
+                               {Glib::Variant<guint32>::create(id),
+                                Glib::Variant<guint32>::create(reason)}));
+  }
+
+  auto NotificationServer::NotificationsClosed(const std::vector<uint32_t>& ids, uint32_t reason)
+    -> void
+  {
+    if (!_connection) return;
+    auto* array = g_variant_new_fixed_array(G_VARIANT_TYPE_UINT32, ids.data(), ids.size(),
+                                            sizeof(uint32_t));
+    _connection->emit_signal(server_path, vendor_interface, "NotificationsClosed", {},
+                             Glib::VariantContainerBase(g_variant_new("(@auu)", array, reason)));
+  }
+
+  auto NotificationServer::ActionInvoked(uint32_t id, const std::string& action_key) -> void
+  {
+    if (!_connection) return;
+    _connection->emit_signal(server_path, server_interface, "ActionInvoked", {},
+                             Glib::VariantContainerBase::create_tuple(
+                               {Glib::Variant<guint32>::create(id),
+                                Glib::Variant<Glib::ustring>::create(action_key)}));
+  }
+
+  auto NotificationServer::GetLatencyStats() -> Glib::VariantBase
+  {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{s(ttttttt)}"));
+    for (std::size_t i = 0; i < latency_stage_count; i++) {
+      auto stage = LatencyStage(i);
+      auto& h = latency[stage];
+      auto us = [](LatencyHistogram::duration d) { return guint64(d.count()); };
+      g_variant_builder_add(&builder, "{s(ttttttt)}", LatencyStats::name(stage), guint64(h.count()),
+                            us(h.min()), us(h.mean()), us(h.percentile(0.5)),
+                            us(h.percentile(0.9)), us(h.percentile(0.99)), us(h.max()));
+    }
+    return Glib::VariantBase(g_variant_builder_end(&builder));
+  }
+
+  auto NotificationServer::ResetLatencyStats() -> void
+  {
+    latency.reset();
+  }
+
+  auto NotificationServer::GetStats() -> Glib::VariantBase
+  {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a{sv}"));
+    auto add = [&](const char* key, guint64 value) {
+      g_variant_builder_add(&builder, "{sv}", key, g_variant_new_uint64(value));
+    };
+    add("shown", notifications.size());
+    add("queued", overflow.size());
+    add("rate-limit-queued", rate_limit_stats.queued);
+    add("rate-limit-dropped", rate_limit_stats.dropped);
+    add("rate-limit-pending", rate_limit_pending());
+    auto cache = image_loader.cache.stats();
+    add("image-cache-hits", cache.hits);
+    add("image-cache-misses", cache.misses);
+    add("image-cache-entries", cache.entries);
+    add("image-cache-bytes", cache.bytes);
+    auto images = image_usage();
+    add("image-bytes-shown", images.shown);
+    add("image-bytes-queued", images.queued);
+    add("image-budget", std::size_t(std::max(client.image_budget_mb, 0)) << 20);
+    add("images-compacted", images_compacted);
+    add("rss", resident_bytes());
+    add("trim-count", trim_stats.count);
+    add("trim-rss-before", trim_stats.rss_before);
+    add("trim-rss-after", trim_stats.rss_after);
+    add("icon-index-entries", icons.size());
+    return Glib::VariantBase(g_variant_builder_end(&builder));
+  }
+
+  auto NotificationServer::rate_limit_pending() const -> std::size_t
+  {
+    std::size_t res = 0;
+    for (auto& [key, queue] : _rate_queues) res += queue.pending.size();
+    return res;
+  }
+
+  auto NotificationServer::ListNotifications(const NotificationFilter& filter)
+    -> Glib::VariantBase
+  {
+    auto now = LatencyStats::clock::now();
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(usssyutb)"));
+    auto add = [&](unsigned id, const NotificationData& data, bool queued) {
+      if (!filter.matches(data, now)) return;
+      auto age = std::chrono::duration_cast<std::chrono::microseconds>(now - data.received);
+      g_variant_builder_add(&builder, "(usssyutb)", guint32(id), data.app_name.c_str(),
+                            data.summary.c_str(), data.body.c_str(), guint8(data.urgency),
+                            guint32(data.count), guint64(age.count()), gboolean(queued));
+    };
+    for (auto& n : notifications) add(n->id, n->data, false);
+    for (auto& [key, queued] : overflow) add(queued.id, queued.data, true);
+    return Glib::VariantBase(g_variant_builder_end(&builder));
+  }
+
+  auto NotificationServer::CloseNotifications(const std::vector<uint32_t>& ids)
+    -> std::vector<uint32_t>
+  {
+    auto closed = close_all(std::vector<unsigned>(ids.begin(), ids.end()), CloseReason::Closed);
+    return std::vector<uint32_t>(closed.begin(), closed.end());
+  }
+
+  auto NotificationServer::CloseMatching(const NotificationFilter& filter)
+    -> std::vector<uint32_t>
+  {
+    auto closed = close_all(matching(filter), CloseReason::Closed);
+    return std::vector<uint32_t>(closed.begin(), closed.end());
+  }
+
+  auto NotificationServer::history() -> NotificationHistory&
+  {
+    if (!_history) {
+      _history.emplace(_history_path);
+      // The mapping stays valid, and the file is gone when the server exits
+      if (_history_temporary) ::unlink(_history_path.c_str());
+    }
+    return *_history;
+  }
+
+  auto NotificationServer::GetHistory(const HistoryQuery& query) -> Glib::VariantBase
+  {
+    GVariantBuilder builder;
+    g_variant_builder_init(&builder, G_VARIANT_TYPE("a(tuxyssss)"));
+    for (auto& entry : history().query(query)) {
+      g_variant_builder_add(&builder, "(tuxyssss)", guint64(entry.seq), entry.id,
+                            gint64(entry.timestamp), entry.urgency, entry.app_name.c_str(),
+                            entry.summary.c_str(), entry.body.c_str(), entry.image.c_str());
+    }
+    return Glib::VariantBase(g_variant_builder_end(&builder));
+  }
+
+  auto NotificationServer::GetCapabilities() -> std::vector<std::string>
   {
     return {"body", "actions", "icon-static"};
   }
 
   auto NotificationServer::Notify(const std::string& app_name,
-                                  const uint32_t& not_id_in,
+                                  uint32_t replaces_id,
                                   const std::string& app_icon,
                                   const std::string& summary,
                                   const std::string& body,
                                   const std::vector<std::string>& actions,
-                                  const std::map<std::string, ::DBus::Variant>& hints,
-                                  const int32_t& expire_timeout_in,
-                                  DBus::Error& err) -> uint32_t
+                                  GVariant* hints,
+                                  int32_t expire_timeout) -> uint32_t
   {
-    try {
-      unsigned notification_id = not_id_in;
-      int expire_timeout = expire_timeout_in;
+    auto received = LatencyStats::clock::now();
+    // Counted as part of the receipt latency
+    start_ui();
+    unsigned notification_id = replaces_id;
+
+    // A notification with the tag of an open one replaces it
+    auto tag = synchronous_tag(hints);
+    if (notification_id == 0 && !tag.empty()) {
+      auto found = _synchronous.find(tag);
+      if (found != _synchronous.end() && is_open(found->second)) notification_id = found->second;
+    }
+    bool replacing = notification_id != 0 && is_open(notification_id);
+    if (notification_id == 0) notification_id = ++_id;
+    if (!tag.empty()) _synchronous[tag] = notification_id;
 
-      if (notification_id == 0) notification_id = ++_id;
+    cloth_info("[{}]: {}", summary, body);
+    std::ostringstream strm;
+    strm << "hints = { ";
+    GVariantIter iter;
+    const gchar* key;
+    GVariant* value;
+    g_variant_iter_init(&iter, hints);
+    while (g_variant_iter_loop(&iter, "{&sv}", &key, &value)) {
+      strm << key << "<" << g_variant_get_type_string(value) << "> ";
+    }
+    strm << " }";
+    cloth_debug("{}", strm.str());
+
+    auto urgency = parse_urgency(hints);
 
-      cloth_info("[{}]: {}", summary, body);
-      std::ostringstream strm;
-      strm << "hints = { ";
-      for (auto& [k, v] : hints) {
-        strm << k << "<" << char(v.reader().type()) << "> ";
+    if (expire_timeout < 0) {
+      switch (urgency) {
+      case Urgency::Low: expire_timeout = 5000; break;
+      case Urgency::Normal: expire_timeout = 10000; break;
+      case Urgency::Critical: expire_timeout = 0; break;
       }
-      strm << " }";
-      cloth_debug("{}", strm.str());
-
-      Urgency urgency = Urgency::Normal;
-      if (hints.count("urgency"))
-        urgency = [&] {
-          auto& urg = hints.at("urgency");
-          switch (urg.reader().type()) {
-          case 'y': return Urgency{uint8_t(urg)};
-          case 'u': return Urgency{uint8_t(uint32_t(urg))};
-          case 'i': return Urgency{uint8_t(int32_t(urg))};
-          default:
-            cloth_error("Urgency hint has wrong type {}", urg.reader().type());
-            return Urgency::Normal;
-          }
-        }();
+    }
+
+    cloth_debug("Timeout: {}", expire_timeout);
+
+    NotificationData data;
+    data.app_name = app_name;
+    data.summary = summary;
+    data.body = body;
+    data.actions = actions;
+    data.urgency = urgency;
+    data.image = get_image_source(hints, app_icon, icons);
+    data.received = received;
+    data.value = parse_value(hints);
+
+    HistoryEntry entry;
+    entry.id = notification_id;
+    entry.timestamp = std::chrono::duration_cast<std::chrono::microseconds>(
+                        std::chrono::system_clock::now().time_since_epoch())
+                        .count();
+    entry.urgency = uint8_t(urgency);
+    entry.app_name = app_name;
+    entry.summary = summary;
+    entry.body = body;
+    if (auto* path = std::get_if<std::string>(&data.image.data)) entry.image = *path;
+    // Progress updates of an open notification are not worth keeping
+    if (!(replacing && data.value >= 0)) history().append(entry);
+
+    auto shown_id = coalesce(notification_id, app_name, data);
 
-      if (expire_timeout < 0) {
-        switch (urgency) {
-        case Urgency::Low: expire_timeout = 5; break;
-        case Urgency::Normal: expire_timeout = 10; break;
-        case Urgency::Critical: expire_timeout = 0; break;
+    latency.record_since(LatencyStage::Receipt, received);
+    show(shown_id, data, expire_timeout);
+    update_idle();
+
+    return notification_id;
+  }
+
+  auto NotificationServer::CloseNotification(uint32_t id) -> void
+  {
+    close(id, CloseReason::Closed);
+  }
+
+  auto NotificationServer::show(unsigned id, const NotificationData& data, int expire_timeout)
+    -> void
+  {
+    if (auto found = by_id.find(id); found != by_id.end()) {
+      // Size changes are reflowed from the size_allocate handler
+      found->second->populate(id, data);
+    } else {
+      if (auto queued = queued_by_id.find(id); queued != queued_by_id.end()) {
+        overflow.erase(queued->second);
+        queued_by_id.erase(queued);
+      }
+      if (stack_full()) {
+        enqueue(id, data, expire_timeout);
+        return;
+      }
+      auto& n = *notifications.emplace_back(acquire());
+      n.stack_pos = std::prev(notifications.end());
+      n.stack_seq = _stack_seq++;
+      by_id[id] = &n;
+      n.populate(id, data);
+      n.map();
+      queue_reflow(n.stack_pos);
+    }
+    if (expire_timeout > 0) {
+      expiry_timers.schedule(id, std::chrono::milliseconds(expire_timeout),
+                             [this, id] { close(id, CloseReason::Expired); });
+    } else {
+      expiry_timers.cancel(id);
+    }
+  }
+
+  auto NotificationServer::close(unsigned id, CloseReason reason) -> void
+  {
+    if (auto alias = coalesced_into.find(id); alias != coalesced_into.end()) {
+      auto shown_id = alias->second;
+      auto& group = coalesce_groups.at(shown_id);
+      coalesced_into.erase(alias);
+      group.aliases.erase(std::remove(group.aliases.begin(), group.aliases.end(), id),
+                          group.aliases.end());
+      group.data.count--;
+      NotificationClosed(id, static_cast<uint32_t>(reason));
+      if (_closing_all) _closed_batch.push_back(id);
+      refresh(shown_id, group.data);
+      return;
+    }
+    if (auto found = by_id.find(id); found != by_id.end()) {
+      auto& n = *found->second;
+      by_id.erase(found);
+      auto notification = std::move(*n.stack_pos);
+      auto next = notifications.erase(n.stack_pos);
+      if (_reflow_from == notification.get()) {
+        _reflow_from = next == notifications.end() ? nullptr : next->get();
+      }
+      emit_closed(id, reason);
+      release(std::move(notification));
+      queue_reflow(next);
+      if (!_closing_all) promote();
+    } else if (auto queued = queued_by_id.find(id); queued != queued_by_id.end()) {
+      overflow.erase(queued->second);
+      queued_by_id.erase(queued);
+      emit_closed(id, reason);
+      if (!_closing_all) update_overflow_summary();
+    }
+    if (!_closing_all) update_idle();
+  }
+
+  auto NotificationServer::close_all(const std::vector<unsigned>& ids, CloseReason reason)
+    -> std::vector<unsigned>
+  {
+    _closed_batch.clear();
+    _closing_all = true;
+    for (auto id : ids) {
+      if (is_open(id)) close(id, reason);
+    }
+    _closing_all = false;
+    auto closed = std::move(_closed_batch);
+    _closed_batch.clear();
+    promote();
+    update_overflow_summary();
+    update_idle();
+    if (!closed.empty()) {
+      NotificationsClosed(std::vector<uint32_t>(closed.begin(), closed.end()),
+                          static_cast<uint32_t>(reason));
+    }
+    return closed;
+  }
+
+  auto NotificationFilter::matches(const NotificationData& data,
+                                   LatencyStats::clock::time_point now) const -> bool
+  {
+    if (!app_name.empty() && data.app_name != app_name) return false;
+    if (urgency && data.urgency != *urgency) return false;
+    return now - data.received >= min_age;
+  }
+
+  auto NotificationServer::matching(const NotificationFilter& filter) const
+    -> std::vector<unsigned>
+  {
+    auto now = LatencyStats::clock::now();
+    std::vector<unsigned> res;
+    for (auto& n : notifications) {
+      if (filter.matches(n->data, now)) res.push_back(n->id);
+    }
+    for (auto& [key, queued] : overflow) {
+      if (filter.matches(queued.data, now)) res.push_back(queued.id);
+    }
+    return res;
+  }
+
+  auto NotificationServer::is_open(unsigned id) const -> bool
+  {
+    return by_id.count(id) || queued_by_id.count(id) || coalesced_into.count(id);
+  }
+
+  auto NotificationServer::latest_id(unsigned id) const -> unsigned
+  {
+    auto group = coalesce_groups.find(id);
+    return group == coalesce_groups.end() ? id : group->second.latest;
+  }
+
+  auto NotificationServer::coalesce(unsigned id,
+                                    const std::string& app_name,
+                                    NotificationData& data) -> unsigned
+  {
+    // Replacing a coalesced notification updates the one it was merged into
+    unsigned shown_id = id;
+    if (auto alias = coalesced_into.find(id); alias != coalesced_into.end()) {
+      shown_id = alias->second;
+    }
+    auto group = coalesce_groups.find(shown_id);
+
+    bool is_new = !by_id.count(shown_id) && !queued_by_id.count(shown_id);
+    if (is_new && client.coalesce_ms > 0 && !app_name.empty()) {
+      auto window = std::chrono::milliseconds(client.coalesce_ms);
+      if (auto latest = _coalesce_by_app.find(app_name); latest != _coalesce_by_app.end()) {
+        auto& target = coalesce_groups.at(latest->second);
+        if (data.received - target.last < window && target.data.urgency == data.urgency) {
+          target.aliases.push_back(id);
+          coalesced_into[id] = latest->second;
+          shown_id = latest->second;
+          data.count = target.data.count + 1;
         }
       }
+      if (shown_id == id) {
+        // Start a new group, later notifications from the app are merged into this one
+        _coalesce_by_app[app_name] = id;
+        coalesce_groups[id].app_name = app_name;
+      }
+      group = coalesce_groups.find(shown_id);
+    } else if (group != coalesce_groups.end()) {
+      // A replacement keeps the count
+      data.count = group->second.data.count;
+    }
+
+    if (group != coalesce_groups.end()) {
+      group->second.latest = id;
+      group->second.data = data;
+      group->second.last = data.received;
+    }
+    return shown_id;
+  }
+
+  auto NotificationServer::refresh(unsigned id, const NotificationData& data) -> void
+  {
+    if (auto found = by_id.find(id); found != by_id.end()) {
+      found->second->populate(id, data);
+    } else if (auto queued = queued_by_id.find(id); queued != queued_by_id.end()) {
+      queued->second->second.data = data;
+    }
+  }
+
+  auto NotificationServer::emit_closed(unsigned id, CloseReason reason) -> void
+  {
+    NotificationClosed(id, static_cast<uint32_t>(reason));
+    if (_closing_all) _closed_batch.push_back(id);
+    auto group = coalesce_groups.find(id);
+    if (group == coalesce_groups.end()) return;
+    for (auto alias : group->second.aliases) {
+      coalesced_into.erase(alias);
+      NotificationClosed(alias, static_cast<uint32_t>(reason));
+      if (_closing_all) _closed_batch.push_back(alias);
+    }
+    auto app = _coalesce_by_app.find(group->second.app_name);
+    if (app != _coalesce_by_app.end() && app->second == id) _coalesce_by_app.erase(app);
+    coalesce_groups.erase(group);
+  }
+
+  auto NotificationServer::enqueue(unsigned id, const NotificationData& data, int expire_timeout)
+    -> void
+  {
+    auto key = std::pair(-static_cast<int>(data.urgency), _arrival++);
+    auto [iter, _] = overflow.emplace(key, QueuedNotification{id, data, expire_timeout});
+    queued_by_id[id] = iter;
+    update_overflow_summary();
+    enforce_image_budget();
+  }
 
-      cloth_debug("Timeout: {}", expire_timeout);
+  auto NotificationServer::image_usage() -> ImageUsage
+  {
+    ImageUsage res;
+    res.cache = image_loader.cache.stats().bytes;
+    for (auto& n : notifications) {
+      if (n->pixbuf) res.shown += ImageCache::byte_size(n->pixbuf);
+    }
+    for (auto& [key, queued] : overflow) res.queued += queued.data.image.byte_size();
+    return res;
+  }
+
+  auto NotificationServer::enforce_image_budget() -> void
+  {
+    auto budget = std::size_t(std::max(client.image_budget_mb, 0)) << 20;
+    auto usage = image_usage();
+    if (usage.total() <= budget) return;
 
-      auto image = get_image(hints, app_icon);
+    // Least urgent and newest first, those are shown last
+    for (auto it = overflow.rbegin(); it != overflow.rend() && usage.total() > budget; ++it) {
+      auto& queued = it->second;
+      if (!std::holds_alternative<RawImage>(queued.data.image.data)) continue;
+      if (_compacting.count(queued.id)) continue;
+      // Assume the scaled image is small compared to the raw data
+      usage.queued -= queued.data.image.byte_size();
+      compact_image(queued.id, queued.data.image);
+    }
+    if (usage.total() > budget) {
+      auto rest = usage.total() - usage.cache;
+      image_loader.cache.trim(budget > rest ? budget - rest : 0);
+    }
+  }
 
-      Glib::signal_idle().connect_once([=] {
-        notifications.underlying().erase(
-          util::remove_if(notifications.underlying(),
-                          [&](auto& n_ptr) { return n_ptr->id == notification_id; }),
-          notifications.underlying().end());
-        notifications.emplace_back(*this, notification_id, summary, body, actions, urgency,
-                                   expire_timeout, image);
-        for (auto& n : notifications) {
-          n.update_padding();
+  auto NotificationServer::compact_image(unsigned id, const ImageSource& source) -> void
+  {
+    // Keeps the buffer's control block alive, so a new buffer at the same
+    // address, after the job released this one, has a different owner
+    std::weak_ptr<const uint8_t> pixels = std::get<RawImage>(source.data).pixels;
+    _compacting.insert(id);
+    image_loader.load(
+      source, Notification::max_image_width, Notification::max_image_height,
+      [this, id, pixels](Glib::RefPtr<Gdk::Pixbuf> pixbuf) {
+        _compacting.erase(id);
+        // Keep the raw data if it could not be decoded, or the job was dropped,
+        // so it is retried when shown
+        if (!pixbuf) return;
+        auto replace = [&](ImageSource& image) {
+          auto* raw = std::get_if<RawImage>(&image.data);
+          if (!raw || raw->pixels.owner_before(pixels) || pixels.owner_before(raw->pixels)) {
+            return false;
+          }
+          image.data = pixbuf;
+          return true;
+        };
+        auto queued = queued_by_id.find(id);
+        if (queued == queued_by_id.end() || !replace(queued->second->second.data.image)) return;
+        // The coalesce group holds on to the same data
+        if (auto group = coalesce_groups.find(id); group != coalesce_groups.end()) {
+          replace(group->second.data.image);
         }
-      });
+        images_compacted++;
+      },
+      ImageLoader::Priority::Background);
+  }
 
-      return notification_id;
-    } catch (std::exception& e) {
-      cloth_error("NotificationServer::Notify: {}", e.what());
-      err = DBus::ErrorFailed(e.what());
-      return not_id_in;
+  auto NotificationServer::promote() -> void
+  {
+    if (overflow.empty()) return;
+    while (!overflow.empty() && !stack_full()) {
+      auto queued = std::move(overflow.begin()->second);
+      overflow.erase(overflow.begin());
+      queued_by_id.erase(queued.id);
+      show(queued.id, queued.data, queued.expire_timeout);
     }
+    update_overflow_summary();
   }
 
-  auto NotificationServer::CloseNotification(const uint32_t& id, DBus::Error& e) -> void
+  auto NotificationServer::stack_full() const -> bool
   {
-    Glib::signal_idle().connect_once([this, id = id] {
-      auto found = util::find_if(notifications, [id](Notification& n) { return n.id == id; });
-      if (found != notifications.end()) notifications.underlying().erase(found.data());
-      for (auto& n : notifications) {
-        n.update_padding();
-      }
-    });
+    return notifications.size() >= std::size_t(std::max(client.max_visible, 1));
+  }
+
+  auto NotificationServer::update_overflow_summary() -> void
+  {
+    if (overflow.empty()) {
+      if (overflow_summary) release(std::move(overflow_summary));
+      return;
+    }
+    NotificationData data;
+    data.summary = fmt::format("+{} more", overflow.size());
+    data.urgency = Urgency::Low;
+    if (!overflow_summary) {
+      overflow_summary = acquire();
+      overflow_summary->populate(0, data);
+      overflow_summary->map();
+    } else {
+      overflow_summary->populate(0, data);
+    }
+    queue_reflow(notifications.end());
+  }
+
+  auto NotificationServer::acquire() -> std::unique_ptr<Notification>
+  {
+    if (pool.empty()) return std::make_unique<Notification>(*this);
+    auto res = std::move(pool.back());
+    pool.pop_back();
+    return res;
+  }
+
+  auto NotificationServer::release(std::unique_ptr<Notification> notification) -> void
+  {
+    expiry_timers.cancel(notification->id);
+    // An unmapped window stops receiving frames, move a pending flush elsewhere
+    if (_reflow_clock_owner == notification.get()) {
+      notification->window.remove_tick_callback(_reflow_tick);
+      _reflow_clock_owner = nullptr;
+      schedule_reflow_flush();
+    }
+    notification->unmap();
+    pool.push_back(std::move(notification));
+    // The notification may be released from one of its own signal handlers,
+    // so never destroy it here
+    if (pool.size() > max_pool_size) {
+      Glib::signal_idle().connect_once([this] { trim_pool(); });
+    }
+  }
+
+  auto NotificationServer::trim_pool() -> void
+  {
+    if (pool.size() > max_pool_size) pool.resize(max_pool_size);
   }
 
   auto NotificationServer::GetServerInformation(std::string& name,
                                                 std::string& vendor,
                                                 std::string& version,
-                                                std::string& spec_version,
-                                                DBus::Error& e) -> void
+                                                std::string& spec_version) -> void
   {
     name = "cloth-notifications";
     vendor = "topisani";
@@ -140,29 +1098,121 @@ namespace cloth::notifications {
     spec_version = "1.2";
   }
 
-  auto NotificationServer::get_padding(Notification& elem) -> int
+  auto NotificationServer::reflow(Stack::iterator from) -> void
   {
-    int res = 0;
-    for (auto& n : notifications) {
-      if (&n == &elem) break;
-      res += n.height;
-      res += 10;
+    int offset = 0;
+    if (from != notifications.begin()) {
+      auto& prev = **std::prev(from);
+      offset = prev.offset + prev.height + stack_spacing;
     }
-    return res;
+    for (; from != notifications.end(); ++from) {
+      auto& n = **from;
+      n.set_offset(offset);
+      offset += n.height + stack_spacing;
+    }
+    if (overflow_summary) overflow_summary->set_offset(offset);
+  }
+
+  auto NotificationServer::queue_reflow(Stack::iterator from) -> void
+  {
+    // The stack surface lays out its own cards
+    if (stack_surface) return;
+    // Notifications are only ever appended, so the stack is ordered by
+    // stack_seq, and the end of the stack comes after everything
+    auto* candidate = from == notifications.end() ? nullptr : from->get();
+    if (!_reflow_pending ||
+        (candidate && (!_reflow_from || candidate->stack_seq < _reflow_from->stack_seq))) {
+      _reflow_from = candidate;
+    }
+    _reflow_pending = true;
+    schedule_reflow_flush();
+  }
+
+  auto NotificationServer::queue_reflow(Notification& from) -> void
+  {
+    auto found = by_id.find(from.id);
+    if (found != by_id.end() && found->second == &from) queue_reflow(from.stack_pos);
+  }
+
+  auto NotificationServer::schedule_reflow_flush() -> void
+  {
+    if (_reflow_clock_owner != nullptr || _reflow_idle.connected()) return;
+    // Any mapped notification window will do, they are all painted on the same
+    // output. Without one, there are no frames to wait for.
+    auto found = util::find_if(notifications, [](auto& n) { return n->window.get_mapped(); });
+    if (found == notifications.end()) {
+      _reflow_idle = Glib::signal_idle().connect([this] {
+        flush_reflow();
+        return false;
+      });
+      return;
+    }
+    _reflow_clock_owner = found->get();
+    _reflow_tick = (*found)->window.add_tick_callback([this](const Glib::RefPtr<Gdk::FrameClock>&) {
+      _reflow_clock_owner = nullptr;
+      flush_reflow();
+      return false;
+    });
+  }
+
+  auto NotificationServer::flush_reflow() -> void
+  {
+    if (!_reflow_pending) return;
+    auto from = _reflow_from ? _reflow_from->stack_pos : notifications.end();
+    _reflow_pending = false;
+    _reflow_from = nullptr;
+    reflow(from);
   }
 
   // Notification //
 
-  Notification::Notification(NotificationServer& server,
-                             unsigned id,
-                             const std::string& title_str,
-                             const std::string& body_str,
-                             const std::vector<std::string>& actions,
-                             Urgency urgency,
-                             int expire_timeout,
-                             std::pair<Glib::RefPtr<Gdk::Pixbuf>, bool> image_data)
-    : server(server), id(id), pixbuf(image_data.first)
+  Notification::Notification(NotificationServer& server) : server(server)
   {
+    body.set_line_wrap(true);
+    body.set_max_width_chars(80);
+
+    // Optional parts are shown and hidden by populate()
+    body.set_no_show_all(true);
+    progress.set_no_show_all(true);
+    actions_box.set_no_show_all(true);
+    image.set_no_show_all(true);
+
+    counter.set_no_show_all(true);
+    counter.get_style_context()->add_class("counter");
+    header_box.pack_start(title);
+    header_box.pack_end(counter, false, false);
+
+    text_box.pack_start(header_box);
+    text_box.pack_start(body);
+    text_box.pack_start(progress);
+    text_box.pack_start(actions_box);
+    content_box.pack_end(text_box);
+    content_box.pack_start(image);
+    content_box.get_style_context()->add_class("notification");
+    card.set_visible_window(false);
+    card.set_halign(Gtk::ALIGN_END);
+    card.add(content_box);
+
+    card.signal_button_press_event().connect([this](GdkEventButton* evt) {
+      this->server.close(this->id, CloseReason::Dismissed);
+      return false;
+    });
+
+    card.signal_draw().connect([this](const Cairo::RefPtr<Cairo::Context>&) {
+      if (_first_frame_pending) {
+        _first_frame_pending = false;
+        this->server.latency.record_since(LatencyStage::FirstFrame, _configured_at);
+        // The overflow summary is not the result of a Notify call
+        if (received != LatencyStats::clock::time_point()) {
+          this->server.latency.record_since(LatencyStage::Total, received);
+        }
+      }
+      return false;
+    });
+
+    // The card is shown on the stack surface, or rendered offscreen instead
+    if (server.stack_surface || server.is_offscreen()) return;
+
     window.set_title("Cloth Notification");
     window.set_decorated(false);
 
@@ -170,117 +1220,231 @@ namespace cloth::notifications {
     server.client.style_context->add_provider_for_screen(screen, server.client.css_provider,
                                                          GTK_STYLE_PROVIDER_PRIORITY_USER);
 
-    title.set_markup(fmt::format("<b>{}</b>", title_str));
-    body.set_text(body_str);
-    body.set_line_wrap(true);
-    body.set_max_width_chars(80);
-    auto& actions_box = *Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
-    auto prev = actions.begin();
-    auto cur = prev + 1;
-    for (; cur != actions.end() && prev != actions.end();
-         std::advance(cur, 2), std::advance(prev, 2)) {
-      auto& action = *prev;
-      auto& label = *cur;
-      auto& button = this->actions.emplace_back(label);
-      button.signal_clicked().connect([this, action = action, label = label] {
-        cloth_debug("Action: {} -> {}", label, action);
-        this->server.ActionInvoked(this->id, action);
-        auto keep_around = util::erase_this(this->server.notifications, this);
-        for (auto& n : this->server.notifications) {
-          n.update_padding();
-        }
-      });
-      actions_box.pack_start(button);
-    }
-    auto& box2 = *Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_VERTICAL));
-    box2.pack_start(title);
-    if (!body_str.empty()) box2.pack_start(body);
-    if (!actions.empty()) box2.pack_start(actions_box);
-
-    auto& box1 = *Gtk::manage(new Gtk::Box(Gtk::ORIENTATION_HORIZONTAL));
-    box1.pack_end(box2);
-
-    if (image_data.first) {
-      auto w = image_data.first->get_width();
-      auto h = image_data.first->get_height();
-      cloth_debug("Image data now: {}, {}", w, h);
-      if (w > max_image_width || h > max_image_height) {
-        auto scale = std::min(max_image_width / float(w), max_image_height / float(h));
-        this->pixbuf =
-          image_data.first->scale_simple(w * scale, h * scale, Gdk::InterpType::INTERP_BILINEAR);
-      }
-      image.set(this->pixbuf);
-      if (image_data.second) image.get_style_context()->add_class("icon");
-      box1.pack_start(image);
-    }
+    window.add(card);
 
-    window.signal_button_press_event().connect([this](GdkEventButton* evt) {
-      auto keep_around = util::erase_this(this->server.notifications, this);
-      for (auto& n : this->server.notifications) {
-        n.update_padding();
-      }
-      return false;
+    window.signal_size_allocate().connect([this](Gtk::Allocation& alloc) {
+      if (alloc.get_width() == this->width && alloc.get_height() == this->height) return;
+      this->width = alloc.get_width();
+      this->height = alloc.get_height();
+      layer_surface.set_size(alloc.get_width(), alloc.get_height());
+      layer_surface.set_exclusive_zone(0);
+      this->server.queue_reflow(*this);
     });
 
-    window.add(box1);
-    switch (urgency) {
-    case Urgency::Low: window.get_style_context()->add_class("urgency-low"); break;
-    case Urgency::Normal: window.get_style_context()->add_class("urgency-normal"); break;
-    case Urgency::Critical: window.get_style_context()->add_class("urgency-critical"); break;
-    }
-
     gtk_widget_realize(GTK_WIDGET(window.gobj()));
     Gdk::wayland::window::set_use_custom_surface(window);
     surface = Gdk::wayland::window::get_wl_surface(window);
+    create_layer_surface();
+  }
+
+  auto Notification::create_layer_surface() -> void
+  {
+    // Destroy the old role object before assigning a new one to the surface
+    layer_surface = wl::zwlr_layer_surface_v1_t();
     layer_surface = server.client.layer_shell.get_layer_surface(
       surface, nullptr, wl::zwlr_layer_shell_v1_layer::top, "cloth.notification");
+    layer_surface_closed = false;
     layer_surface.set_anchor(wl::zwlr_layer_surface_v1_anchor::top |
                              wl::zwlr_layer_surface_v1_anchor::right);
-    layer_surface.set_size(1, 1);
-    layer_surface.on_configure() = [&](uint32_t serial, uint32_t width, uint32_t height) {
+    layer_surface.on_configure() = [this](uint32_t serial, uint32_t width, uint32_t height) {
       cloth_debug("Configured {}x{}", width, height);
+      if (_configure_pending) {
+        _configure_pending = false;
+        _first_frame_pending = true;
+        _configured_at = LatencyStats::clock::now();
+        server.latency.record(LatencyStage::Configure, _configured_at - _mapped_at);
+      }
       layer_surface.ack_configure(serial);
-      window.show_all();
-      if (width != window.get_width()) {
-        this->height = window.get_height();
-        layer_surface.set_size(window.get_width(), window.get_height());
-        layer_surface.set_exclusive_zone(0);
-        update_padding();
+      if (_updates_frozen) {
+        _updates_frozen = false;
+        window.get_window()->thaw_updates();
+        // Attach a buffer for the new contents, the surface has none since unmap()
+        window.queue_draw();
       }
+      window.show_all();
+    };
+    layer_surface.on_closed() = [this] {
+      layer_surface_closed = true;
+      server.close(id, CloseReason::Undefined);
     };
-    layer_surface.on_closed() = [&] {
-      auto keep_around = util::erase_this(this->server.notifications, this);
-      for (auto& n : server.notifications) {
-        n.update_padding();
+  }
+
+  auto Notification::populate(unsigned id, const NotificationData& data) -> void
+  {
+    auto start = LatencyStats::clock::now();
+    auto image_identity = data.image.identity();
+    auto* raw = std::get_if<RawImage>(&data.image.data);
+    std::weak_ptr<const uint8_t> image_pixels;
+    if (raw) image_pixels = raw->pixels;
+    // The last buffer's control block is kept alive by _image_pixels, so a
+    // new buffer at the same address has a different owner
+    bool same_image = image_identity == _image && !image_pixels.owner_before(_image_pixels) &&
+                      !_image_pixels.owner_before(image_pixels);
+    // Replacements that only change the text or progress, like volume and
+    // brightness OSDs sending several per second, are updated in place
+    bool in_place = id != 0 && id == this->id && data.actions == this->data.actions &&
+                    same_image && data.urgency == this->data.urgency;
+    this->id = id;
+    this->received = data.received;
+    this->data = data;
+    this->data.image = {};
+
+    bool text_changed = false;
+    auto set_label = [&](Gtk::Label& label, const Glib::ustring& text, bool markup) {
+      if (label.get_label() == text) return;
+      text_changed = true;
+      if (markup) {
+        label.set_markup(text);
+      } else {
+        label.set_text(text);
       }
     };
+    set_label(title, fmt::format("<b>{}</b>", data.summary), true);
+    set_label(counter, fmt::format("×{}", data.count), false);
+    counter.set_visible(data.count > 1);
+    set_label(body, data.body, false);
+    body.set_visible(!data.body.empty());
+    // Only redraws the bar, its size doesn't depend on the value
+    if (data.value >= 0) progress.set_fraction(data.value / 100.0);
+    progress.set_visible(data.value >= 0);
 
-    window.resize(1, 1);
+    if (in_place) {
+      if (text_changed) shrink();
+      server.latency.record_since(LatencyStage::Build, start);
+      return;
+    }
+    generation++;
+    _image = std::move(image_identity);
+    _image_pixels = std::move(image_pixels);
 
-    surface.commit();
+    actions.underlying().clear();
+    for (std::size_t i = 0; i + 1 < data.actions.size(); i += 2) {
+      auto& action = data.actions[i];
+      auto& label = data.actions[i + 1];
+      auto& button = actions.emplace_back(label);
+      button.signal_clicked().connect([this, action = action, label = label] {
+        cloth_debug("Action: {} -> {}", label, action);
+        this->server.ActionInvoked(this->server.latest_id(this->id), action);
+        this->server.close(this->id, CloseReason::Dismissed);
+      });
+      actions_box.pack_start(button);
+      button.show();
+    }
+    actions_box.set_visible(!actions.empty());
 
-    sleeper_thread = [this, expire_timeout] {
-      sleeper_thread.sleep_for(chrono::seconds(expire_timeout));
-      if (expire_timeout > 0 && sleeper_thread.running()) {
-        Glib::signal_idle().connect_once([this] {
-          auto keep_around = util::erase_this(this->server.notifications, this);
-          for (auto& n : this->server.notifications) {
-            n.update_padding();
-          }
+    // Show a placeholder until the image is decoded
+    pixbuf.reset();
+    image.get_style_context()->remove_class("icon");
+    image.get_style_context()->remove_class("loading");
+    if (data.image.empty()) {
+      image.clear();
+      image.hide();
+    } else {
+      image.set_from_icon_name("image-loading", Gtk::ICON_SIZE_DIALOG);
+      image.get_style_context()->add_class("loading");
+      image.show();
+      server.image_loader.load(
+        data.image, max_image_width, max_image_height,
+        [&server = server, id, generation = generation, is_icon = data.image.is_icon,
+         requested = start](auto pixbuf) {
+          server.latency.record_since(LatencyStage::Decode, requested);
+          // The window may have been re-populated or destroyed in the meantime
+          auto found = server.by_id.find(id);
+          if (found == server.by_id.end() || found->second->generation != generation) return;
+          found->second->set_image(pixbuf, is_icon);
         });
-      }
-      sleeper_thread.stop();
-    };
-  } // namespace cloth::notifications
+    }
+
+    auto style = content_box.get_style_context();
+    style->remove_class("urgency-low");
+    style->remove_class("urgency-normal");
+    style->remove_class("urgency-critical");
+    switch (data.urgency) {
+    case Urgency::Low: style->add_class("urgency-low"); break;
+    case Urgency::Normal: style->add_class("urgency-normal"); break;
+    case Urgency::Critical: style->add_class("urgency-critical"); break;
+    }
+
+    shrink();
+
+    server.latency.record_since(LatencyStage::Build, start);
+  }
+
+  auto Notification::shrink() -> void
+  {
+    // Shrink to fit the new contents
+    if (server.stack_surface) {
+      server.stack_surface->shrink();
+    } else {
+      window.resize(1, 1);
+    }
+  }
 
-  Notification::~Notification()
+  auto Notification::set_image(Glib::RefPtr<Gdk::Pixbuf> pixbuf, bool is_icon) -> void
   {
-    server.NotificationClosed(id, 0);
+    this->pixbuf = std::move(pixbuf);
+    image.get_style_context()->remove_class("loading");
+    if (!this->pixbuf) {
+      image.clear();
+      image.hide();
+      return;
+    }
+    cloth_debug("Image data now: {}, {}", this->pixbuf->get_width(), this->pixbuf->get_height());
+    image.set(this->pixbuf);
+    if (is_icon) image.get_style_context()->add_class("icon");
+    image.show();
+  }
+
+  auto Notification::map() -> void
+  {
+    if (server.stack_surface) {
+      server.stack_surface->add(card, this == server.overflow_summary.get());
+      // The card is drawn on the next frame of the already configured surface
+      _first_frame_pending = true;
+      _configured_at = LatencyStats::clock::now();
+      return;
+    }
+    // The window stays shown while pooled, so its wl_surface and layer
+    // surface are reused. A layer surface closed by the compositor is
+    // recreated on the same wl_surface
+    if (layer_surface_closed) create_layer_surface();
+    offset = -1;
+    _configure_pending = true;
+    _first_frame_pending = false;
+    _mapped_at = LatencyStats::clock::now();
+    // A reused window keeps its last size until the new contents are allocated
+    layer_surface.set_size(std::max(width, 1), std::max(height, 1));
+    // Committing without a buffer asks the compositor for a configure
+    surface.commit();
+  }
+
+  auto Notification::unmap() -> void
+  {
+    // Action buttons are cleared by the next populate(), since this may be
+    // called from their signal handlers
+    if (server.stack_surface) {
+      server.stack_surface->remove(card);
+    } else {
+      // Hiding the window would make GDK destroy the wl_surface. Instead, stop
+      // GDK from drawing, so it attaches no buffer before the next configure,
+      // and unmap the layer surface by committing a null buffer
+      if (!_updates_frozen) {
+        _updates_frozen = true;
+        window.get_window()->freeze_updates();
+      }
+      surface.attach(wl::buffer_t(), 0, 0);
+      surface.commit();
+    }
+    pixbuf.reset();
+    image.clear();
+    id = 0;
   }
 
-  void Notification::update_padding()
+  auto Notification::set_offset(int offset) -> void
   {
-    layer_surface.set_margin(20 + server.get_padding(*this), 20, 20, 20);
+    if (offset == this->offset) return;
+    this->offset = offset;
+    layer_surface.set_margin(20 + offset, 20, 20, 20);
     surface.commit();
   }
 
@@ -2,18 +2,24 @@
 
 #include "util/logging.hpp"
 
+#include <deque>
 #include <gtkmm.h>
+#include <list>
+#include <optional>
+#include <unordered_map>
+#include <unordered_set>
 
 #include <protocols.hpp>
 #include <util/ptr_vec.hpp>
-#include <util/chrono.hpp>
 
-#include <dbus-notifications-adaptor.hpp>
-
-// These macro names are a bit too generic, dbus++
-#undef bind_property
-#undef register_method
-#undef connect_signal
+#include "icon-index.hpp"
+#include "image-loader.hpp"
+#include "latency-stats.hpp"
+#include "notification-history.hpp"
+#include "notification-trace.hpp"
+#include "rate-limiter.hpp"
+#include "stack-surface.hpp"
+#include "timer-scheduler.hpp"
 
 namespace cloth::notifications {
 
@@ -26,75 +32,578 @@ namespace cloth::notifications {
     Low = 0, Normal = 1, Critical = 2
   };
 
+  /// Reasons passed with the `NotificationClosed` signal
+  enum struct CloseReason {
+    Expired = 1, Dismissed = 2, Closed = 3, Undefined = 4
+  };
+
+  /// The contents of a notification, independent of the window showing it
+  struct NotificationData {
+    std::string app_name;
+    std::string summary;
+    std::string body;
+    std::vector<std::string> actions;
+    Urgency urgency = Urgency::Normal;
+    ImageSource image;
+    /// When the `Notify` call was received
+    LatencyStats::clock::time_point received;
+    /// Number of notifications coalesced into this one
+    unsigned count = 1;
+    /// Progress in percent, from the `value` hint. -1 if there is none
+    int value = -1;
+  };
+
+  /// Selects open notifications for the bulk vendor methods
+  struct NotificationFilter {
+    /// Only notifications from this application. Empty for all
+    std::string app_name;
+    /// Only notifications with this urgency. Empty for all
+    std::optional<Urgency> urgency;
+    /// Only notifications received at least this long ago
+    std::chrono::microseconds min_age{0};
+
+    auto matches(const NotificationData& data, LatencyStats::clock::time_point now) const
+      -> bool;
+  };
+
+  /// A notification card, and the window and layer surface showing it.
+  ///
+  /// Windows are pooled by the server, and re-populated with new contents for
+  /// every notification they show. In single surface mode, the card is shown
+  /// on the server's `StackSurface` instead, and the window is never realized.
   struct Notification {
 
     static constexpr unsigned max_image_width = 100;
     static constexpr unsigned max_image_height = 100;
 
-    Notification(NotificationServer& server,
-                 unsigned id,
-                 const std::string& title,
-                 const std::string& body,
-                 const std::vector<std::string>& actions,
-                 Urgency urgency,
-                 int expire_timeout,
-                 std::pair<Glib::RefPtr<Gdk::Pixbuf>, bool> pixbuf = {});
-
-    ~Notification();
+    Notification(NotificationServer& server);
 
     Notification(const Notification&) = delete;
 
     NotificationServer& server;
-    const unsigned id;
+    unsigned id = 0;
 
+    int width = 0;
     int height = 0;
 
-    void update_padding();
+    /// Incremented every time the window is populated with a new image or
+    /// actions
+    unsigned generation = 0;
+
+    /// When the `Notify` call for the current contents was received
+    LatencyStats::clock::time_point received;
+
+    /// The contents currently shown, without the image
+    NotificationData data;
+
+    /// Replace the contents of the window.
+    ///
+    /// The image is decoded asynchronously, a placeholder is shown until then.
+    /// If only the text or progress of the shown notification changed, the
+    /// labels and progress bar are updated in place, and the rest of the
+    /// widgets are left alone.
+    auto populate(unsigned id, const NotificationData& data) -> void;
+
+    /// Show a decoded image, or hide the image if `pixbuf` is empty
+    auto set_image(Glib::RefPtr<Gdk::Pixbuf> pixbuf, bool is_icon) -> void;
+
+    /// Map the layer surface, or add the card to the stack surface. The window
+    /// is shown, or drawn again, when it is configured
+    auto map() -> void;
+
+    /// Unmap the layer surface or remove the card from the stack surface,
+    /// keeping them around for reuse. The window itself stays shown, so GDK
+    /// keeps its wl_surface
+    auto unmap() -> void;
+
+    /// Offset from the top of the stack, as last sent to the compositor
+    int offset = -1;
+
+    /// Position in `NotificationServer::notifications`, while shown
+    std::list<std::unique_ptr<Notification>>::iterator stack_pos;
+    /// Increases with every notification added to the stack
+    uint64_t stack_seq = 0;
+
+    /// Move the notification to `offset` in the stack.
+    ///
+    /// Only updates the margin and commits if the offset changed
+    auto set_offset(int offset) -> void;
 
     Glib::RefPtr<Gdk::Pixbuf> pixbuf;
     Gtk::Window window;
+    /// Takes input for the card
+    Gtk::EventBox card;
+    Gtk::Box content_box {Gtk::ORIENTATION_HORIZONTAL};
+    Gtk::Box text_box {Gtk::ORIENTATION_VERTICAL};
+    Gtk::Box header_box {Gtk::ORIENTATION_HORIZONTAL};
+    Gtk::Box actions_box {Gtk::ORIENTATION_HORIZONTAL};
     Gtk::Image image;
     Gtk::Label title;
+    /// The number of coalesced notifications
+    Gtk::Label counter;
     Gtk::Label body;
-    std::vector<Gtk::Button> actions;
-    util::SleeperThread sleeper_thread;
+    /// Shown for notifications with a `value` hint
+    Gtk::ProgressBar progress;
+    util::ptr_vec<Gtk::Button> actions;
 
     wl::surface_t surface;
     wl::zwlr_layer_surface_v1_t layer_surface;
+
+  private:
+    auto create_layer_surface() -> void;
+    /// Shrink the window or stack surface to fit the card
+    auto shrink() -> void;
+
+    bool layer_surface_closed = false;
+    /// Set while unmapped, until the next configure event
+    bool _updates_frozen = false;
+
+    /// The image the widgets were last built for, to detect in place updates
+    std::string _image;
+    /// The raw image buffer the widgets were last built for, if any
+    std::weak_ptr<const uint8_t> _image_pixels;
+
+    /// Set by map() until the first configure event
+    bool _configure_pending = false;
+    /// Set by the first configure event until the window is drawn
+    bool _first_frame_pending = false;
+    LatencyStats::clock::time_point _mapped_at;
+    LatencyStats::clock::time_point _configured_at;
   };
 
-  struct NotificationServer : org::freedesktop::Notifications_adaptor,
-                              DBus::IntrospectableAdaptor,
-                              DBus::ObjectAdaptor {
+  /// The `org.freedesktop.Notifications` service.
+  ///
+  /// Served with GDBus on the GTK main loop, so method calls are dispatched
+  /// on the same thread that owns the notification windows.
+  struct NotificationServer {
     static inline const std::string server_path = "/org/freedesktop/Notifications";
     static inline const std::string server_name = "org.freedesktop.Notifications";
+    static inline const std::string server_interface = "org.freedesktop.Notifications";
+    /// Extensions specific to cloth-notifications
+    static inline const std::string vendor_interface = "org.tablecloth.Notifications";
+
+    /// Number of windows kept in the pool when no notifications are shown
+    static constexpr std::size_t max_pool_size = 8;
+    /// Number of windows created ahead of the first notification
+    static constexpr std::size_t prewarm_pool_size = 2;
+
+    /// Request the bus name on the session bus. The object is registered once
+    /// the bus connection is acquired.
+    ///
+    /// Also installs a SIGUSR1 handler, which logs the latency stats. If the
+    /// client has not initialized its UI yet, that is done on the first
+    /// notification
+    NotificationServer(Client& client);
 
+    struct Offscreen {};
+    static constexpr Offscreen offscreen = {};
 
-    NotificationServer(Client& client, DBus::Connection& connection)
-      : DBus::ObjectAdaptor(connection, server_path), client(client)
-    {}
+    /// A server that is not on the bus, and only builds notification cards
+    /// for rendering them offscreen. See `render_offscreen()`
+    NotificationServer(Client& client, Offscreen);
 
-    auto GetCapabilities(DBus::Error& e) -> std::vector<std::string> override;
-    auto Notify(const std::string&,
-                const uint32_t&,
-                const std::string&,
-                const std::string&,
-                const std::string&,
-                const std::vector<std::string>&,
-                const std::map<std::string, ::DBus::Variant>&,
-                const int32_t&, DBus::Error& e) -> uint32_t override;
-    auto CloseNotification(const uint32_t&, DBus::Error& e) -> void override;
-    auto GetServerInformation(std::string&, std::string&, std::string&, std::string&, DBus::Error& e)
-      -> void override;
+    struct Replay {};
+    static constexpr Replay replay = {};
+
+    /// A server for replaying a trace with `TraceReplay`. Shows notifications
+    /// like the server on the bus, but doesn't request the bus name or
+    /// record, and keeps its history in an unlinked temporary file, so a
+    /// replay leaves the running session and its history alone
+    NotificationServer(Client& client, Replay);
+
+    NotificationServer(const NotificationServer&) = delete;
+    ~NotificationServer();
+
+    auto GetCapabilities() -> std::vector<std::string>;
+    /// \param hints The `a{sv}` hints dictionary. Not consumed
+    auto Notify(const std::string& app_name,
+                uint32_t replaces_id,
+                const std::string& app_icon,
+                const std::string& summary,
+                const std::string& body,
+                const std::vector<std::string>& actions,
+                GVariant* hints,
+                int32_t expire_timeout) -> uint32_t;
+    auto CloseNotification(uint32_t id) -> void;
+    auto GetServerInformation(std::string& name,
+                              std::string& vendor,
+                              std::string& version,
+                              std::string& spec_version) -> void;
+
+    /// Emit the `NotificationClosed` signal
+    auto NotificationClosed(uint32_t id, uint32_t reason) -> void;
+    /// Emit the `ActionInvoked` signal
+    auto ActionInvoked(uint32_t id, const std::string& action_key) -> void;
+
+    /// Latency histograms as an `a{s(ttttttt)}`, stage name to
+    /// `(count, min, mean, p50, p90, p99, max)` in microseconds
+    auto GetLatencyStats() -> Glib::VariantBase;
+    auto ResetLatencyStats() -> void;
+    /// Parse the arguments of a `Notify` call, and handle it.
+    ///
+    /// \returns The notification id
+    auto notify(GVariant* parameters) -> uint32_t;
+
+    /// Counters and sizes, as an `a{sv}`
+    auto GetStats() -> Glib::VariantBase;
+    /// A page of history entries as an `a(tuxyssss)`
+    auto GetHistory(const HistoryQuery& query) -> Glib::VariantBase;
+    /// Open notifications matching `filter` as an `a(usssyutb)`, shown ones
+    /// first, in stack order, then queued ones
+    auto ListNotifications(const NotificationFilter& filter) -> Glib::VariantBase;
+    /// Close every open notification in `ids` in one pass. See `close_all()`
+    ///
+    /// \returns The ids that were open
+    auto CloseNotifications(const std::vector<uint32_t>& ids) -> std::vector<uint32_t>;
+    /// Close every open notification matching `filter` in one pass
+    ///
+    /// \returns The ids that were closed
+    auto CloseMatching(const NotificationFilter& filter) -> std::vector<uint32_t>;
+    /// Emitted once per bulk close, after the `NotificationClosed` signals
+    auto NotificationsClosed(const std::vector<uint32_t>& ids, uint32_t reason) -> void;
 
     Client& client;
 
-    auto get_padding(Notification&) -> int;
+    /// Whether the server was created with `offscreen`. Its notifications have
+    /// no window or layer surface
+    auto is_offscreen() const noexcept -> bool
+    {
+      return _offscreen;
+    }
+
+    /// Vertical space between stacked notifications
+    static constexpr int stack_spacing = 10;
+
+    using Stack = std::list<std::unique_ptr<Notification>>;
+
+    /// Recompute the stack offsets of the notifications from `from` onwards,
+    /// using the cached offset of the one above it.
+    auto reflow(Stack::iterator from) -> void;
+
+    /// Queue a reflow from `from`.
+    ///
+    /// Queued reflows are merged, and flushed once on the next frame of a
+    /// mapped notification window, so a burst of changes results in at most
+    /// one commit per surface.
+    auto queue_reflow(Stack::iterator from) -> void;
+
+    /// Queue a reflow from the given notification onwards.
+    ///
+    /// Since its own offset is unchanged, only the ones below it move
+    auto queue_reflow(Notification& from) -> void;
+
+    /// Show a notification, or update it if one with the same id is already shown.
+    ///
+    /// Notifications are queued if the stack is full.
+    auto show(unsigned id, const NotificationData& data, int expire_timeout) -> void;
+
+    /// Close the notification with the given id, if it is shown or queued.
+    ///
+    /// Closing a notification closes everything coalesced into it. Closing
+    /// one of those only removes it from the count.
+    auto close(unsigned id, CloseReason reason) -> void;
+
+    /// Close several notifications, promoting queued notifications into the
+    /// stack and updating the overflow summary once at the end, instead of
+    /// after every close. Unknown ids are skipped.
+    ///
+    /// \returns Every id that was closed, including the ones coalesced into
+    ///          the closed notifications
+    auto close_all(const std::vector<unsigned>& ids, CloseReason reason) -> std::vector<unsigned>;
+
+    /// Ids of the open notifications matching `filter`, shown ones first
+    auto matching(const NotificationFilter& filter) const -> std::vector<unsigned>;
+
+    /// The id of the notification whose contents are shown with `id`.
+    ///
+    /// Differs from `id` when other notifications were coalesced into it
+    auto latest_id(unsigned id) const -> unsigned;
+
+    /// Expiry timers for all notifications, keyed on notification id
+    TimerScheduler expiry_timers;
+
+    /// Time spent between `Notify` calls and their windows being drawn
+    LatencyStats latency;
+
+    /// Every notification received, including ones that are no longer shown.
+    ///
+    /// The file is mapped on first use, so a lazily started server doesn't
+    /// touch it until the first notification or query
+    auto history() -> NotificationHistory&;
+
+    /// The surface showing all notifications, in single surface mode
+    std::unique_ptr<StackSurface> stack_surface;
+
+    /// Records `Notify` and `CloseNotification` calls, with `--record`
+    std::unique_ptr<TraceWriter> trace;
+
+    /// Per sender token buckets for `Notify` calls
+    RateLimiter rate_limiter;
+
+    struct RateLimitStats {
+      /// Calls delayed until their sender had tokens again
+      uint64_t queued = 0;
+      /// Calls rejected with an error
+      uint64_t dropped = 0;
+    };
+    RateLimitStats rate_limit_stats;
+
+    /// Number of calls currently delayed by the rate limits
+    auto rate_limit_pending() const -> std::size_t;
+
+    /// Maximum number of delayed `Notify` calls per sender and urgency.
+    /// Calls beyond that are rejected
+    static constexpr std::size_t max_rate_queue = 32;
 
-    util::ptr_vec<Notification> notifications;
+    /// Decodes notification images off the GTK thread
+    ImageLoader image_loader;
+
+    /// Memory used by notification images, in bytes
+    struct ImageUsage {
+      /// Decoded images in the image cache
+      std::size_t cache = 0;
+      /// Images of shown notifications. These may also be in the cache
+      std::size_t shown = 0;
+      /// Image data held by queued notifications
+      std::size_t queued = 0;
+
+      auto total() const noexcept -> std::size_t
+      {
+        return cache + shown + queued;
+      }
+    };
+    auto image_usage() -> ImageUsage;
+
+    /// Number of queued images replaced by their scaled down form
+    uint64_t images_compacted = 0;
+
+    struct TrimStats {
+      /// Number of times memory was released while idle
+      uint64_t count = 0;
+      /// Resident set size in bytes, before and after the last release
+      std::size_t rss_before = 0;
+      std::size_t rss_after = 0;
+    };
+    TrimStats trim_stats;
+
+    /// Destroy pooled windows, clear the image cache and return free heap
+    /// memory to the system. Called after `Client::trim_idle_s` without
+    /// notifications
+    auto release_memory() -> void;
+
+    /// Resolves icon names sent as `app_icon` or `image-path`
+    IconIndex icons{Notification::max_image_width};
+
+    /// Shown notifications, in display order from the top.
+    ///
+    /// A list, so notifications can be removed in constant time using their
+    /// `stack_pos`
+    Stack notifications;
+
+    /// Shown notifications by id
+    std::unordered_map<unsigned, Notification*> by_id;
+
+    /// Unmapped windows ready to be populated with new notifications
+    std::vector<std::unique_ptr<Notification>> pool;
+
+    /// A notification waiting for space in the stack
+    struct QueuedNotification {
+      unsigned id;
+      NotificationData data;
+      int expire_timeout;
+    };
+
+    /// Notifications that did not fit in the stack, keyed on
+    /// `(-urgency, arrival)`, so the most urgent and then oldest comes first.
+    std::map<std::pair<int, uint64_t>, QueuedNotification> overflow;
+
+    /// Queued notifications by id
+    std::unordered_map<unsigned, decltype(overflow)::iterator> queued_by_id;
+
+    /// The "+N more" window shown below the stack while `overflow` is not empty
+    std::unique_ptr<Notification> overflow_summary;
+
+    /// Notifications from one application, merged into the first of them
+    struct CoalesceGroup {
+      std::string app_name;
+      /// Ids of the notifications merged into the first
+      std::vector<unsigned> aliases;
+      /// The id of the most recent notification
+      unsigned latest = 0;
+      /// The contents of the most recent notification, with the total count
+      NotificationData data;
+      LatencyStats::clock::time_point last;
+    };
+
+    /// Coalesce groups, keyed on the id they are shown with
+    std::unordered_map<unsigned, CoalesceGroup> coalesce_groups;
+
+    /// The group each coalesced notification was merged into
+    std::unordered_map<unsigned, unsigned> coalesced_into;
 
   private:
-    unsigned _id;
+    auto on_bus_acquired(const Glib::RefPtr<Gio::DBus::Connection>& connection,
+                         const Glib::ustring& name) -> void;
+
+    auto on_method_call(const Glib::RefPtr<Gio::DBus::Connection>& connection,
+                        const Glib::ustring& sender,
+                        const Glib::ustring& object_path,
+                        const Glib::ustring& interface_name,
+                        const Glib::ustring& method_name,
+                        const Glib::VariantContainerBase& parameters,
+                        const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation) -> void;
+
+    auto on_vendor_method_call(const Glib::RefPtr<Gio::DBus::Connection>& connection,
+                               const Glib::ustring& sender,
+                               const Glib::ustring& object_path,
+                               const Glib::ustring& interface_name,
+                               const Glib::ustring& method_name,
+                               const Glib::VariantContainerBase& parameters,
+                               const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation)
+      -> void;
+
+    /// Check a `Notify` call against the rate limits, before parsing more
+    /// than its urgency.
+    ///
+    /// \returns true if the call should be handled now. Otherwise it was
+    ///          queued, or rejected with an error
+    auto admit_notify(const Glib::ustring& sender,
+                      const Glib::VariantContainerBase& parameters,
+                      const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation) -> bool;
+
+    /// Parse the arguments of a `Notify` call, and reply to it
+    auto handle_notify(const Glib::ustring& sender,
+                       const Glib::VariantContainerBase& parameters,
+                       const Glib::RefPtr<Gio::DBus::MethodInvocation>& invocation) -> void;
+
+    auto rate_limit(Urgency urgency) const -> RateLimiter::Rate;
+
+    /// `Notify` calls waiting for tokens from one bucket
+    struct RateQueue {
+      struct Pending {
+        Glib::ustring sender;
+        Glib::VariantContainerBase parameters;
+        Glib::RefPtr<Gio::DBus::MethodInvocation> invocation;
+      };
+      RateLimiter::Rate rate;
+      std::deque<Pending> pending;
+      sigc::connection timer;
+    };
+
+    auto schedule_rate_drain(const std::string& key) -> void;
+    /// Handle queued calls for as long as the bucket has tokens
+    auto drain_rate_queue(const std::string& key) -> void;
+
+    /// Delayed calls, keyed on rate limiter bucket
+    std::unordered_map<std::string, RateQueue> _rate_queues;
+
+    guint _owner_id = 0;
+    std::vector<guint> _registration_ids;
+    Glib::RefPtr<Gio::DBus::Connection> _connection;
+    Gio::DBus::InterfaceVTable _vtable;
+    Gio::DBus::InterfaceVTable _vendor_vtable;
+    bool _offscreen = false;
+    std::optional<NotificationHistory> _history;
+    /// Where the history is kept, see `history()`
+    std::string _history_path = NotificationHistory::default_path();
+    /// Unlink the history file once it is mapped
+    bool _history_temporary = false;
+    /// Set by `close_all()`, to leave promoting queued notifications to it
+    bool _closing_all = false;
+    /// Every id `NotificationClosed` was emitted for during `close_all()`
+    std::vector<unsigned> _closed_batch;
+
+    /// Set up what every server showing notifications needs: the SIGUSR1
+    /// handler, the UI unless it is started lazily, and the idle timers
+    auto init() -> void;
+
+    /// Initialize the client UI, and everything that needs it. Called on the
+    /// first notification in lazy mode
+    auto start_ui() -> void;
+    bool _ui_started = false;
+
+    /// Start or stop the `--exit-idle` and `--trim-idle` timers, depending on
+    /// whether anything is shown or queued
+    auto update_idle() -> void;
+    /// Nothing is shown, queued or waiting for the rate limits
+    auto is_idle() const -> bool;
+    sigc::connection _idle_timer;
+    sigc::connection _trim_timer;
+
+    guint _sigusr1_source = 0;
+
+    /// Take a window from the pool, or create one if the pool is empty
+    auto acquire() -> std::unique_ptr<Notification>;
+
+    /// Unmap the window and return it to the pool
+    auto release(std::unique_ptr<Notification> notification) -> void;
+
+    /// Destroy pooled windows in excess of `max_pool_size`
+    auto trim_pool() -> void;
+
+    auto enqueue(unsigned id, const NotificationData& data, int expire_timeout) -> void;
+
+    /// Bring the image memory back under `Client::image_budget_mb`.
+    ///
+    /// Queued notifications are not visible, so raw image data they hold is
+    /// decoded and scaled to what would be shown, which is then kept instead.
+    /// Images are re-materialized from that form when shown. If that is not
+    /// enough, the image cache is trimmed.
+    auto enforce_image_budget() -> void;
+
+    /// Replace the raw image data of queued notification `id` with its
+    /// scaled image, once that is decoded
+    auto compact_image(unsigned id, const ImageSource& source) -> void;
+
+    /// Queued notifications with an image being compacted
+    std::unordered_set<unsigned> _compacting;
+
+    /// Move queued notifications into the stack while there is space
+    auto promote() -> void;
+
+    auto update_overflow_summary() -> void;
+
+    /// Merge a new notification into the last one from the same application,
+    /// if it arrived within the coalescing window.
+    ///
+    /// \returns The id to show `data` with
+    auto coalesce(unsigned id, const std::string& app_name, NotificationData& data) -> unsigned;
+
+    /// Update the contents of a shown or queued notification, without
+    /// touching its expiry timer
+    auto refresh(unsigned id, const NotificationData& data) -> void;
+
+    /// Emit `NotificationClosed` for `id` and everything coalesced into it
+    auto emit_closed(unsigned id, CloseReason reason) -> void;
+
+    /// The latest coalesce group of each application
+    std::unordered_map<std::string, unsigned> _coalesce_by_app;
+
+    /// Whether `id` is shown, queued or coalesced into another notification
+    auto is_open(unsigned id) const -> bool;
+
+    /// The last notification id sent with each `x-canonical-private-synchronous`
+    /// tag. Closed ids are left in place, there is one entry per tag
+    std::unordered_map<std::string, unsigned> _synchronous;
+
+    auto stack_full() const -> bool;
+
+    uint64_t _arrival = 0;
+    uint64_t _stack_seq = 0;
+
+    auto schedule_reflow_flush() -> void;
+    auto flush_reflow() -> void;
+
+    bool _reflow_pending = false;
+    /// The topmost notification with a pending reflow, or null to only reflow
+    /// the overflow summary
+    Notification* _reflow_from = nullptr;
+    /// The notification whose frame clock will flush the pending reflow
+    Notification* _reflow_clock_owner = nullptr;
+    guint _reflow_tick = 0;
+    sigc::connection _reflow_idle;
+
+    unsigned _id = 0;
   };
 
 
@@ -0,0 +1,201 @@
+#include "notification-trace.hpp"
+
+#include <cstring>
+#include <vector>
+
+#include "client.hpp"
+#include "notification-server.hpp"
+
+#include "util/logging.hpp"
+
+namespace cloth::notifications {
+
+  namespace {
+    constexpr char trace_magic[8] = {'C', 'L', 'O', 'T', 'H', 'T', 'R', '1'};
+
+    struct RecordHeader {
+      uint64_t time;
+      uint32_t id;
+      /// Size of the serialized arguments following the header
+      uint32_t size;
+      uint8_t call;
+      uint8_t reserved[7];
+    };
+
+    auto parameter_type(TraceCall call) -> const GVariantType*
+    {
+      switch (call) {
+      case TraceCall::Notify: return G_VARIANT_TYPE("(susssasa{sv}i)");
+      case TraceCall::CloseNotification: return G_VARIANT_TYPE("(u)");
+      }
+      return nullptr;
+    }
+  } // namespace
+
+  // TraceWriter //
+
+  TraceWriter::TraceWriter(const std::string& path)
+    : _file(path, std::ios::binary | std::ios::trunc), _start(std::chrono::steady_clock::now())
+  {
+    if (!_file) {
+      cloth_error("Could not open trace file {}: {}", path, std::strerror(errno));
+      _file.close();
+      return;
+    }
+    _file.write(trace_magic, sizeof(trace_magic));
+  }
+
+  auto TraceWriter::write(TraceCall call, GVariant* parameters, uint32_t id) -> void
+  {
+    if (!is_open()) return;
+    auto* normal = g_variant_get_normal_form(parameters);
+    RecordHeader header = {};
+    header.time = std::chrono::duration_cast<std::chrono::microseconds>(
+                    std::chrono::steady_clock::now() - _start)
+                    .count();
+    header.id = id;
+    header.size = g_variant_get_size(normal);
+    header.call = uint8_t(call);
+    _file.write(reinterpret_cast<const char*>(&header), sizeof(header));
+    _file.write(static_cast<const char*>(g_variant_get_data(normal)), header.size);
+    _file.flush();
+    g_variant_unref(normal);
+  }
+
+  // TraceReader //
+
+  TraceReader::TraceReader(const std::string& path) : _file(path, std::ios::binary)
+  {
+    char magic[sizeof(trace_magic)] = {};
+    if (!_file.read(magic, sizeof(magic)) ||
+        std::memcmp(magic, trace_magic, sizeof(magic)) != 0) {
+      cloth_error("{} is not a notification trace", path);
+      _file.close();
+    }
+  }
+
+  auto TraceReader::read() -> std::optional<TraceRecord>
+  {
+    if (!is_open()) return std::nullopt;
+    RecordHeader header;
+    if (!_file.read(reinterpret_cast<char*>(&header), sizeof(header))) return std::nullopt;
+    auto* type = parameter_type(TraceCall(header.call));
+    if (!type) {
+      cloth_error("Unknown call {} in trace", header.call);
+      return std::nullopt;
+    }
+    // Memory from g_malloc is aligned for any GVariant
+    auto* data = static_cast<char*>(g_malloc(header.size));
+    if (!_file.read(data, header.size)) {
+      g_free(data);
+      return std::nullopt;
+    }
+    auto* bytes = g_bytes_new_take(data, header.size);
+    TraceRecord res;
+    res.call = TraceCall(header.call);
+    res.time = header.time;
+    res.id = header.id;
+    res.parameters = Glib::VariantContainerBase(g_variant_new_from_bytes(type, bytes, false));
+    g_bytes_unref(bytes);
+    return res;
+  }
+
+  // TraceReplay //
+
+  TraceReplay::TraceReplay(NotificationServer& server, const std::string& path, double speed)
+    : _server(server), _reader(path), _speed(speed)
+  {}
+
+  TraceReplay::~TraceReplay()
+  {
+    _timer.disconnect();
+  }
+
+  auto TraceReplay::start() -> void
+  {
+    _start = clock::now();
+    _next = _reader.read();
+    step();
+  }
+
+  auto TraceReplay::step() -> void
+  {
+    while (_next) {
+      if (_speed > 0) {
+        auto due = _start + std::chrono::duration_cast<clock::duration>(
+                              std::chrono::duration<double, std::micro>(_next->time / _speed));
+        auto now = clock::now();
+        if (due > now) {
+          auto wait = std::chrono::ceil<std::chrono::milliseconds>(due - now);
+          _timer = Glib::signal_timeout().connect(
+            [this] {
+              step();
+              return false;
+            },
+            wait.count());
+          return;
+        }
+      }
+      send(*_next);
+      _next = _reader.read();
+      if (_speed <= 0 && _next) {
+        // One call per main loop iteration, so the notifications are still drawn
+        _timer = Glib::signal_idle().connect([this] {
+          step();
+          return false;
+        });
+        return;
+      }
+    }
+    finish();
+  }
+
+  auto TraceReplay::send(const TraceRecord& record) -> void
+  {
+    auto* params = const_cast<GVariant*>(record.parameters.gobj());
+    auto mapped = [&](uint32_t id) -> uint32_t {
+      auto found = _ids.find(id);
+      return found == _ids.end() ? 0 : found->second;
+    };
+    _sent++;
+    try {
+      if (record.call == TraceCall::Notify) {
+        uint32_t replaces_id;
+        g_variant_get_child(params, 1, "u", &replaces_id);
+        if (replaces_id != 0) {
+          // Rebuild the arguments with the id of the replayed notification
+          auto n = g_variant_n_children(params);
+          std::vector<GVariant*> children(n);
+          for (std::size_t i = 0; i < n; i++) children[i] = g_variant_get_child_value(params, i);
+          g_variant_unref(children[1]);
+          children[1] = g_variant_ref_sink(g_variant_new_uint32(mapped(replaces_id)));
+          auto rebuilt = Glib::VariantContainerBase(g_variant_new_tuple(children.data(), n));
+          for (auto* child : children) g_variant_unref(child);
+          _ids[record.id] = _server.notify(const_cast<GVariant*>(rebuilt.gobj()));
+        } else {
+          _ids[record.id] = _server.notify(params);
+        }
+      } else {
+        if (auto id = mapped(record.id)) _server.CloseNotification(id);
+      }
+    } catch (std::exception& e) {
+      cloth_error("Replaying call: {}", e.what());
+    }
+  }
+
+  auto TraceReplay::finish() -> void
+  {
+    auto elapsed = std::chrono::duration<double>(clock::now() - _start).count();
+    cloth_info("Replayed {} calls in {:.3f}s, {:.1f} calls/s", _sent, elapsed,
+               elapsed > 0 ? _sent / elapsed : 0.0);
+    // Give the last notifications a chance to be drawn
+    _timer = Glib::signal_timeout().connect_seconds(
+      [this] {
+        cloth_info("Notification latency:\n{}", _server.latency.report());
+        _server.client.quit();
+        return false;
+      },
+      1);
+  }
+
+} // namespace cloth::notifications
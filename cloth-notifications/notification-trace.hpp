@@ -0,0 +1,111 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <unordered_map>
+
+#include <giomm.h>
+
+namespace cloth::notifications {
+
+  struct NotificationServer;
+
+  /// The calls kept in a trace
+  enum struct TraceCall : uint8_t {
+    Notify = 0, CloseNotification = 1
+  };
+
+  /// One recorded call
+  struct TraceRecord {
+    TraceCall call = TraceCall::Notify;
+    /// Microseconds since the recording started
+    uint64_t time = 0;
+    /// The id returned by `Notify`, or closed by `CloseNotification`
+    uint32_t id = 0;
+    /// The arguments of the call, including hints and image data
+    Glib::VariantContainerBase parameters;
+  };
+
+  /// Records `Notify` and `CloseNotification` calls to a trace file.
+  ///
+  /// The file starts with an 8 byte magic, followed by one fixed-size header
+  /// per call, and the arguments of the call in the GVariant serialization
+  /// format. That is in native byte order, so traces are only read back on
+  /// machines with the same endianness.
+  ///
+  /// Every record is flushed as it is written, so a trace of a session that
+  /// crashed is still complete.
+  struct TraceWriter {
+    TraceWriter(const std::string& path);
+    TraceWriter(const TraceWriter&) = delete;
+
+    auto is_open() const noexcept -> bool
+    {
+      return _file.is_open();
+    }
+
+    auto write(TraceCall call, GVariant* parameters, uint32_t id) -> void;
+
+  private:
+    std::ofstream _file;
+    std::chrono::steady_clock::time_point _start;
+  };
+
+  /// Reads the records of a trace file in order
+  struct TraceReader {
+    TraceReader(const std::string& path);
+    TraceReader(const TraceReader&) = delete;
+
+    auto is_open() const noexcept -> bool
+    {
+      return _file.is_open();
+    }
+
+    /// The next record, or nothing at the end of the file or on a truncated
+    /// record
+    auto read() -> std::optional<TraceRecord>;
+
+  private:
+    std::ifstream _file;
+  };
+
+  /// Drives the calls of a trace into a `NotificationServer`, bypassing
+  /// D-Bus and the rate limits. The server is normally created with
+  /// `NotificationServer::replay`.
+  ///
+  /// Ids in the trace are mapped to the ids the server assigns while
+  /// replaying, so replacements and closes hit the right notifications. Once
+  /// the trace is done, the throughput and latency stats are logged, and the
+  /// client quits.
+  struct TraceReplay {
+    /// \param speed Playback speed relative to the recording. 0 or less to
+    ///        send every call as soon as the previous one is handled
+    TraceReplay(NotificationServer& server, const std::string& path, double speed);
+    TraceReplay(const TraceReplay&) = delete;
+    ~TraceReplay();
+
+    auto start() -> void;
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    /// Send every call that is due, and schedule the next one
+    auto step() -> void;
+    auto send(const TraceRecord& record) -> void;
+    auto finish() -> void;
+
+    NotificationServer& _server;
+    TraceReader _reader;
+    double _speed;
+    std::optional<TraceRecord> _next;
+    clock::time_point _start;
+    uint64_t _sent = 0;
+    /// Recorded id to replayed id
+    std::unordered_map<uint32_t, uint32_t> _ids;
+    sigc::connection _timer;
+  };
+
+} // namespace cloth::notifications
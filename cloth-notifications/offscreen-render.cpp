@@ -0,0 +1,114 @@
+#include "offscreen-render.hpp"
+
+#include <algorithm>
+#include <array>
+#include <iostream>
+
+#include "client.hpp"
+#include "latency-stats.hpp"
+
+namespace cloth::notifications {
+
+  namespace {
+    enum struct RenderStep { Construct, Populate, Image, Layout, Draw };
+    constexpr std::size_t render_step_count = 5;
+
+    constexpr std::array<const char*, render_step_count> render_step_names = {
+      "construct", "populate", "image", "layout", "draw",
+    };
+
+    auto report(const std::array<LatencyHistogram, render_step_count>& steps) -> std::string
+    {
+      auto ms = [](LatencyHistogram::duration d) { return d.count() / 1000.0; };
+      std::string res = fmt::format("{:<12} {:>8} {:>9} {:>9} {:>9} {:>9} {:>9}\n", "step",
+                                    "count", "min ms", "mean ms", "p50 ms", "p99 ms", "max ms");
+      for (std::size_t i = 0; i < render_step_count; i++) {
+        auto& h = steps[i];
+        res += fmt::format("{:<12} {:>8} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f} {:>9.3f}\n",
+                           render_step_names[i], h.count(), ms(h.min()), ms(h.mean()),
+                           ms(h.percentile(0.5)), ms(h.percentile(0.99)), ms(h.max()));
+      }
+      return res;
+    }
+  } // namespace
+
+  auto render_offscreen(Client& client) -> int
+  {
+    using clock = LatencyStats::clock;
+    NotificationServer server(client, NotificationServer::offscreen);
+
+    NotificationData data;
+    data.app_name = "cloth-notifications";
+    data.summary = client.render_summary;
+    data.body = client.render_body;
+    for (int i = 0; i < client.render_actions; i++) {
+      data.actions.push_back(fmt::format("action-{}", i));
+      data.actions.push_back(fmt::format("Action {}", i));
+    }
+    // The image is decoded on this thread, so it can be timed on its own
+    ImageSource image;
+    if (!client.render_image.empty()) {
+      image.data = IconIndex::is_path(client.render_image)
+                     ? client.render_image
+                     : server.icons.lookup(client.render_image);
+      if (std::get<std::string>(image.data).empty()) {
+        cloth_error("No icon named {}", client.render_image);
+        return 1;
+      }
+    }
+
+    auto screen = Gdk::Screen::get_default();
+    client.style_context->add_provider_for_screen(screen, client.css_provider,
+                                                  GTK_STYLE_PROVIDER_PRIORITY_USER);
+
+    std::array<LatencyHistogram, render_step_count> steps;
+    auto record = [&](RenderStep step, clock::time_point& since) {
+      auto now = clock::now();
+      steps[std::size_t(step)].record(
+        std::chrono::duration_cast<LatencyHistogram::duration>(now - since));
+      since = now;
+    };
+
+    Cairo::RefPtr<Cairo::ImageSurface> surface;
+    for (int i = 0; i < std::max(client.render_iterations, 1); i++) {
+      auto start = clock::now();
+      // Built from scratch every time, like a notification that misses the pool
+      auto n = std::make_unique<Notification>(server);
+      Gtk::OffscreenWindow window;
+      window.add(n->card);
+      record(RenderStep::Construct, start);
+
+      n->populate(i + 1, data);
+      record(RenderStep::Populate, start);
+
+      if (!image.empty()) {
+        auto source = image;
+        n->set_image(ImageLoader::decode(source, Notification::max_image_width,
+                                         Notification::max_image_height),
+                     false);
+      }
+      record(RenderStep::Image, start);
+
+      window.show_all();
+      window.check_resize();
+      record(RenderStep::Layout, start);
+
+      auto alloc = window.get_allocation();
+      surface = Cairo::ImageSurface::create(Cairo::FORMAT_ARGB32, std::max(alloc.get_width(), 1),
+                                            std::max(alloc.get_height(), 1));
+      auto cr = Cairo::Context::create(surface);
+      window.draw(cr);
+      surface->flush();
+      record(RenderStep::Draw, start);
+
+      window.remove();
+    }
+
+    surface->write_to_png(client.render_png);
+    std::cout << fmt::format("Rendered {}x{} to {}\n", surface->get_width(),
+                             surface->get_height(), client.render_png)
+              << report(steps);
+    return 0;
+  }
+
+} // namespace cloth::notifications
@@ -0,0 +1,21 @@
+#pragma once
+
+namespace cloth::notifications {
+
+  struct Client;
+
+  /// Build the notification described by the client's `--render-*` options,
+  /// lay it out and draw it to an image surface, `Client::render_iterations`
+  /// times, without a compositor or the session bus.
+  ///
+  /// The last rendering is written to `Client::render_png`, and the time
+  /// spent constructing the widgets, populating them (which parses the
+  /// summary markup), decoding and scaling the image, laying out and drawing
+  /// is printed per step.
+  ///
+  /// GTK must already be initialized, see `Client::init_gtk()`
+  ///
+  /// \returns The exit code
+  auto render_offscreen(Client& client) -> int;
+
+} // namespace cloth::notifications
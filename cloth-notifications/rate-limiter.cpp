@@ -0,0 +1,57 @@
+#include "rate-limiter.hpp"
+
+#include <algorithm>
+
+namespace cloth::notifications {
+
+  auto RateLimiter::bucket(const std::string& key, const Rate& rate, clock::time_point now)
+    -> Bucket&
+  {
+    if (_buckets.size() >= sweep_threshold) sweep(now);
+    auto [iter, inserted] = _buckets.try_emplace(key);
+    auto& bucket = iter->second;
+    if (inserted) {
+      bucket.tokens = rate.burst;
+    } else {
+      auto elapsed = std::chrono::duration<double>(now - bucket.last).count();
+      bucket.tokens = std::min(rate.burst, bucket.tokens + elapsed * rate.per_second);
+    }
+    bucket.last = now;
+    return bucket;
+  }
+
+  auto RateLimiter::try_acquire(const std::string& key, const Rate& rate, clock::time_point now)
+    -> bool
+  {
+    if (rate.unlimited()) return true;
+    auto& b = bucket(key, rate, now);
+    if (b.tokens < 1) return false;
+    b.tokens -= 1;
+    auto refill = std::chrono::duration<double>((rate.burst - b.tokens) / rate.per_second);
+    b.full_at = now + std::chrono::duration_cast<clock::duration>(refill);
+    return true;
+  }
+
+  auto RateLimiter::time_until_token(const std::string& key,
+                                     const Rate& rate,
+                                     clock::time_point now) -> clock::duration
+  {
+    if (rate.unlimited()) return clock::duration::zero();
+    auto& b = bucket(key, rate, now);
+    if (b.tokens >= 1) return clock::duration::zero();
+    auto wait = std::chrono::duration<double>((1 - b.tokens) / rate.per_second);
+    return std::chrono::duration_cast<clock::duration>(wait);
+  }
+
+  auto RateLimiter::sweep(clock::time_point now) -> void
+  {
+    for (auto iter = _buckets.begin(); iter != _buckets.end();) {
+      if (iter->second.full_at <= now) {
+        iter = _buckets.erase(iter);
+      } else {
+        ++iter;
+      }
+    }
+  }
+
+} // namespace cloth::notifications
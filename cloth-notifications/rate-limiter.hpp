@@ -0,0 +1,60 @@
+#pragma once
+
+#include <chrono>
+#include <string>
+#include <unordered_map>
+
+namespace cloth::notifications {
+
+  /// Token buckets keyed on a string, like a D-Bus sender name.
+  ///
+  /// Every bucket starts full, and is refilled continuously at its rate. Full
+  /// buckets are indistinguishable from new ones, so they are forgotten once
+  /// there are many of them.
+  struct RateLimiter {
+    using clock = std::chrono::steady_clock;
+
+    struct Rate {
+      /// Tokens added per second. Zero or less for no limit
+      double per_second = 0;
+      /// Size of the bucket, the number of tokens that can be taken at once
+      double burst = 1;
+
+      auto unlimited() const noexcept -> bool
+      {
+        return per_second <= 0;
+      }
+    };
+
+    /// Take a token from the bucket for `key`.
+    ///
+    /// \returns false, without taking anything, if the bucket is empty
+    auto try_acquire(const std::string& key, const Rate& rate, clock::time_point now = clock::now())
+      -> bool;
+
+    /// Time until the bucket for `key` has a token again
+    auto time_until_token(const std::string& key,
+                          const Rate& rate,
+                          clock::time_point now = clock::now()) -> clock::duration;
+
+  private:
+    struct Bucket {
+      double tokens = 0;
+      clock::time_point last;
+      /// When the bucket will be full again, if nothing is taken from it
+      clock::time_point full_at;
+    };
+
+    /// Find or create the bucket for `key`, refilled up to `now`
+    auto bucket(const std::string& key, const Rate& rate, clock::time_point now) -> Bucket&;
+
+    /// Forget buckets that are full again
+    auto sweep(clock::time_point now) -> void;
+
+    /// Number of buckets before full ones are swept
+    static constexpr std::size_t sweep_threshold = 256;
+
+    std::unordered_map<std::string, Bucket> _buckets;
+  };
+
+} // namespace cloth::notifications
@@ -0,0 +1,141 @@
+#include "stack-surface.hpp"
+
+#include <algorithm>
+
+#include "client.hpp"
+
+#include "gdkwayland.hpp"
+
+namespace cloth::notifications {
+
+  StackSurface::StackSurface(NotificationServer& server) : server(server)
+  {
+    window.set_title("Cloth Notifications");
+    window.set_decorated(false);
+    // The gaps between cards are transparent
+    auto screen = window.get_screen();
+    window.set_visual(screen->get_rgba_visual());
+    window.get_style_context()->add_class("stack");
+    server.client.style_context->add_provider_for_screen(screen, server.client.css_provider,
+                                                         GTK_STYLE_PROVIDER_PRIORITY_USER);
+
+    cards.set_spacing(NotificationServer::stack_spacing);
+    cards.set_valign(Gtk::ALIGN_START);
+    window.add(cards);
+    cards.show();
+
+    window.signal_size_allocate().connect([this](Gtk::Allocation& alloc) {
+      if (alloc.get_width() == _width && alloc.get_height() == _height) return;
+      _width = alloc.get_width();
+      _height = alloc.get_height();
+      layer_surface.set_size(_width, _height);
+      layer_surface.set_exclusive_zone(0);
+    });
+    // Runs after the box has allocated the cards
+    cards.signal_size_allocate().connect([this](Gtk::Allocation&) { update_input_region(); });
+
+    gtk_widget_realize(GTK_WIDGET(window.gobj()));
+    Gdk::wayland::window::set_use_custom_surface(window);
+    surface = Gdk::wayland::window::get_wl_surface(window);
+    create_layer_surface();
+  }
+
+  auto StackSurface::create_layer_surface() -> void
+  {
+    layer_surface = wl::zwlr_layer_surface_v1_t();
+    layer_surface = server.client.layer_shell.get_layer_surface(
+      surface, nullptr, wl::zwlr_layer_shell_v1_layer::top, "cloth.notification");
+    _layer_surface_closed = false;
+    layer_surface.set_anchor(wl::zwlr_layer_surface_v1_anchor::top |
+                             wl::zwlr_layer_surface_v1_anchor::right);
+    layer_surface.set_margin(20, 20, 20, 20);
+    layer_surface.on_configure() = [this](uint32_t serial, uint32_t width, uint32_t height) {
+      cloth_debug("Stack configured {}x{}", width, height);
+      if (_configure_pending) {
+        _configure_pending = false;
+        server.latency.record_since(LatencyStage::Configure, _mapped_at);
+      }
+      layer_surface.ack_configure(serial);
+      if (_updates_frozen) {
+        _updates_frozen = false;
+        window.get_window()->thaw_updates();
+        window.queue_draw();
+      }
+      window.show();
+    };
+    layer_surface.on_closed() = [this] {
+      _layer_surface_closed = true;
+      // The next card maps a new layer surface, even if some stay in the stack
+      unmap();
+      std::vector<unsigned> ids;
+      for (auto& n : this->server.notifications) ids.push_back(n->id);
+      // In one pass, so queued notifications are only promoted once all are closed
+      this->server.close_all(ids, CloseReason::Undefined);
+    };
+  }
+
+  auto StackSurface::map() -> void
+  {
+    // The window stays shown while empty, so the wl_surface is reused
+    if (_layer_surface_closed) create_layer_surface();
+    _mapped = true;
+    _configure_pending = true;
+    _mapped_at = LatencyStats::clock::now();
+    layer_surface.set_size(std::max(_width, 1), std::max(_height, 1));
+    surface.commit();
+  }
+
+  auto StackSurface::add(Gtk::Widget& card, bool footer) -> void
+  {
+    cards.pack_start(card, false, false);
+    card.show_all();
+    if (footer) {
+      _footer = &card;
+    } else if (_footer) {
+      cards.reorder_child(*_footer, -1);
+    }
+    if (!_mapped || _layer_surface_closed) map();
+  }
+
+  auto StackSurface::remove(Gtk::Widget& card) -> void
+  {
+    if (card.get_parent() != &cards) return;
+    if (_footer == &card) _footer = nullptr;
+    cards.remove(card);
+    if (cards.get_children().empty()) {
+      unmap();
+    } else {
+      shrink();
+    }
+  }
+
+  auto StackSurface::unmap() -> void
+  {
+    // Hiding the window would destroy the wl_surface, see Notification::unmap()
+    if (!_updates_frozen) {
+      _updates_frozen = true;
+      window.get_window()->freeze_updates();
+    }
+    // A new layer surface can only be created on a surface without a buffer
+    surface.attach(wl::buffer_t(), 0, 0);
+    surface.commit();
+    _mapped = false;
+  }
+
+  auto StackSurface::shrink() -> void
+  {
+    window.resize(1, 1);
+  }
+
+  auto StackSurface::update_input_region() -> void
+  {
+    auto region = Cairo::Region::create();
+    for (auto* card : cards.get_children()) {
+      if (!card->get_visible()) continue;
+      auto alloc = card->get_allocation();
+      region->do_union({alloc.get_x(), alloc.get_y(), alloc.get_width(), alloc.get_height()});
+    }
+    window.input_shape_combine_region(region);
+  }
+
+} // namespace cloth::notifications
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <gtkmm.h>
+
+#include <protocols.hpp>
+
+#include "latency-stats.hpp"
+
+namespace cloth::notifications {
+
+  namespace wl = wayland;
+
+  struct NotificationServer;
+
+  /// One window and layer surface showing the cards of every visible
+  /// notification, used instead of a window per notification with
+  /// `--single-surface`.
+  ///
+  /// The cards are stacked by a `Gtk::Box`, so only the cards that change are
+  /// redrawn and damaged. The input region is set to the cards, so the gaps
+  /// between them don't take input.
+  struct StackSurface {
+    StackSurface(NotificationServer& server);
+    StackSurface(const StackSurface&) = delete;
+
+    /// Add a card to the bottom of the stack, mapping the surface if it was
+    /// empty.
+    ///
+    /// \param footer Keep the card below all cards added after it
+    auto add(Gtk::Widget& card, bool footer = false) -> void;
+
+    /// Remove a card, unmapping the surface when the last one is removed
+    auto remove(Gtk::Widget& card) -> void;
+
+    /// Shrink the window to fit its cards
+    auto shrink() -> void;
+
+    NotificationServer& server;
+
+    Gtk::Window window;
+    Gtk::Box cards {Gtk::ORIENTATION_VERTICAL};
+
+    wl::surface_t surface;
+    wl::zwlr_layer_surface_v1_t layer_surface;
+
+  private:
+    auto create_layer_surface() -> void;
+    auto map() -> void;
+    /// Unmap the layer surface, keeping the window shown
+    auto unmap() -> void;
+    auto update_input_region() -> void;
+
+    Gtk::Widget* _footer = nullptr;
+    bool _mapped = false;
+    bool _layer_surface_closed = false;
+    /// Set while unmapped, until the next configure event
+    bool _updates_frozen = false;
+    bool _configure_pending = false;
+    LatencyStats::clock::time_point _mapped_at;
+    int _width = 0;
+    int _height = 0;
+  };
+
+} // namespace cloth::notifications
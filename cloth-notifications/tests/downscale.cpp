@@ -0,0 +1,162 @@
+/// Compares every implementation of `downscale_area` that runs on this CPU
+/// against a double precision reference, over random images of various
+/// sizes, scale factors, strides and channel counts.
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include <fmt/format.h>
+
+#include "../downscale.hpp"
+
+namespace cloth::notifications::tests {
+
+  using detail::SimdLevel;
+
+  struct Image {
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    int channels = 4;
+    std::vector<uint8_t> pixels;
+
+    Image(int width, int height, int channels, int padding = 0)
+      : width(width),
+        height(height),
+        stride(width * channels + padding),
+        channels(channels),
+        pixels(std::size_t(stride) * height)
+    {}
+
+    auto at(int x, int y) -> uint8_t*
+    {
+      return pixels.data() + std::size_t(y) * stride + x * channels;
+    }
+  };
+
+  /// How much of the source pixel `i` is covered by `[start, end)`
+  auto coverage(int i, double start, double end) -> double
+  {
+    return std::max(0.0, std::min(end, i + 1.0) - std::max(start, double(i)));
+  }
+
+  /// Area averaging with premultiplied alpha, in doubles
+  auto reference(Image& src, int dst_width, int dst_height) -> Image
+  {
+    Image dst(dst_width, dst_height, src.channels);
+    double sx = double(src.width) / dst_width;
+    double sy = double(src.height) / dst_height;
+    for (int y = 0; y < dst_height; y++) {
+      for (int x = 0; x < dst_width; x++) {
+        double x0 = x * sx, x1 = (x + 1) * sx;
+        double y0 = y * sy, y1 = (y + 1) * sy;
+        double acc[4] = {0, 0, 0, 0};
+        double area = 0;
+        for (int j = int(y0); j < std::min(int(std::ceil(y1)), src.height); j++) {
+          for (int i = int(x0); i < std::min(int(std::ceil(x1)), src.width); i++) {
+            double w = coverage(i, x0, x1) * coverage(j, y0, y1);
+            auto* px = src.at(i, j);
+            double a = src.channels == 4 ? px[3] : 255;
+            for (int c = 0; c < 3; c++) acc[c] += w * px[c] * a;
+            acc[3] += w * a;
+            area += w;
+          }
+        }
+        auto* out = dst.at(x, y);
+        for (int c = 0; c < 3; c++) {
+          out[c] = acc[3] > 0 ? uint8_t(std::lround(std::clamp(acc[c] / acc[3], 0.0, 255.0))) : 0;
+        }
+        if (src.channels == 4) out[3] = uint8_t(std::lround(acc[3] / area));
+      }
+    }
+    return dst;
+  }
+
+  auto level_name(SimdLevel level) -> const char*
+  {
+    switch (level) {
+    case SimdLevel::Scalar: return "scalar";
+    case SimdLevel::SSE2: return "sse2";
+    case SimdLevel::AVX2: return "avx2";
+    }
+    return "";
+  }
+
+  /// The largest difference of any channel from the reference
+  auto check(SimdLevel level, Image& src, int dst_width, int dst_height, Image& expected) -> int
+  {
+    // Padding in the destination too, which must be left alone
+    Image dst(dst_width, dst_height, src.channels, 3);
+    std::fill(dst.pixels.begin(), dst.pixels.end(), 0xab);
+    detail::downscale_area(level, src.pixels.data(), src.width, src.height, src.stride,
+                           dst.pixels.data(), dst.width, dst.height, dst.stride, dst.channels);
+    int max_error = 0;
+    for (int y = 0; y < dst_height; y++) {
+      for (int x = 0; x < dst_width; x++) {
+        for (int c = 0; c < dst.channels; c++) {
+          max_error = std::max(max_error, std::abs(dst.at(x, y)[c] - expected.at(x, y)[c]));
+        }
+      }
+      for (int i = dst_width * dst.channels; i < dst.stride; i++) {
+        if (dst.at(0, y)[i] != 0xab) return 256;
+      }
+    }
+    return max_error;
+  }
+
+  auto run() -> int
+  {
+    struct Case {
+      int src_width, src_height, dst_width, dst_height;
+    };
+    const std::vector<Case> cases = {
+      {1, 1, 1, 1},       {16, 16, 16, 16}, {64, 64, 1, 1},    {64, 48, 32, 24},
+      {100, 100, 33, 33}, {101, 77, 50, 9}, {512, 512, 100, 100}, {640, 480, 100, 75},
+      {37, 301, 7, 100},  {301, 37, 100, 7}, {1920, 1080, 100, 56},
+    };
+
+    std::vector<SimdLevel> levels = {SimdLevel::Scalar};
+    auto supported = detail::downscale_simd_level();
+    if (supported >= SimdLevel::SSE2) levels.push_back(SimdLevel::SSE2);
+    if (supported >= SimdLevel::AVX2) levels.push_back(SimdLevel::AVX2);
+
+    std::mt19937 rng(1234);
+    std::uniform_int_distribution<int> byte(0, 255);
+    int failures = 0;
+    for (int channels : {3, 4}) {
+      for (auto& c : cases) {
+        Image src(c.src_width, c.src_height, channels, 5);
+        for (auto& b : src.pixels) b = uint8_t(byte(rng));
+        // Fully transparent and opaque pixels, which are common in icons
+        if (channels == 4) {
+          for (int y = 0; y < src.height; y++) {
+            for (int x = 0; x < src.width; x++) {
+              if ((x + y) % 7 == 0) src.at(x, y)[3] = 0;
+              if ((x + y) % 5 == 0) src.at(x, y)[3] = 255;
+            }
+          }
+        }
+        auto expected = reference(src, c.dst_width, c.dst_height);
+        for (auto level : levels) {
+          int error = check(level, src, c.dst_width, c.dst_height, expected);
+          bool ok = error <= 1;
+          if (!ok) failures++;
+          std::cout << fmt::format("{:<6} {}ch {}x{} -> {}x{}: max error {}{}\n",
+                                   level_name(level), channels, c.src_width, c.src_height,
+                                   c.dst_width, c.dst_height, error, ok ? "" : " FAILED");
+        }
+      }
+    }
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+  }
+
+} // namespace cloth::notifications::tests
+
+int main()
+{
+  return cloth::notifications::tests::run();
+}
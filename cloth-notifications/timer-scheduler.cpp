@@ -0,0 +1,67 @@
+#include "timer-scheduler.hpp"
+
+#include <algorithm>
+#include <vector>
+
+namespace cloth::notifications {
+
+  TimerScheduler::~TimerScheduler()
+  {
+    _timeout.disconnect();
+  }
+
+  auto TimerScheduler::schedule(unsigned key, std::chrono::milliseconds delay, Callback callback)
+    -> void
+  {
+    cancel(key);
+    auto iter = _timers.emplace(clock::now() + delay, Entry{key, std::move(callback)});
+    _by_key[key] = iter;
+    rearm();
+  }
+
+  auto TimerScheduler::cancel(unsigned key) -> bool
+  {
+    auto found = _by_key.find(key);
+    if (found == _by_key.end()) return false;
+    _timers.erase(found->second);
+    _by_key.erase(found);
+    rearm();
+    return true;
+  }
+
+  auto TimerScheduler::rearm() -> void
+  {
+    if (_timers.empty()) {
+      _timeout.disconnect();
+      return;
+    }
+    auto deadline = _timers.begin()->first;
+    if (_timeout.connected() && _armed_for == deadline) return;
+    _timeout.disconnect();
+    _armed_for = deadline;
+    auto delay = std::chrono::ceil<std::chrono::milliseconds>(deadline - clock::now());
+    _timeout = Glib::signal_timeout().connect(sigc::mem_fun(*this, &TimerScheduler::on_timeout),
+                                              std::max<long>(delay.count(), 0));
+  }
+
+  auto TimerScheduler::on_timeout() -> bool
+  {
+    // The source is destroyed when we return false, drop our handle first so
+    // callbacks scheduling new timers connect a fresh one
+    _timeout = {};
+
+    std::vector<Callback> due;
+    auto now = clock::now();
+    while (!_timers.empty() && _timers.begin()->first <= now) {
+      auto& entry = _timers.begin()->second;
+      due.push_back(std::move(entry.callback));
+      _by_key.erase(entry.key);
+      _timers.erase(_timers.begin());
+    }
+    for (auto& cb : due) cb();
+
+    rearm();
+    return false;
+  }
+
+} // namespace cloth::notifications
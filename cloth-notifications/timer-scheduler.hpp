@@ -0,0 +1,54 @@
+#pragma once
+
+#include <chrono>
+#include <functional>
+#include <map>
+#include <unordered_map>
+
+#include <glibmm.h>
+
+namespace cloth::notifications {
+
+  /// Runs keyed one-shot callbacks on the GLib main loop.
+  ///
+  /// All timers share a single GLib timeout, which is always armed for the
+  /// earliest pending deadline. Not thread safe, only use from the GTK thread.
+  struct TimerScheduler {
+    using clock = std::chrono::steady_clock;
+    using Callback = std::function<void()>;
+
+    TimerScheduler() = default;
+    TimerScheduler(const TimerScheduler&) = delete;
+    ~TimerScheduler();
+
+    /// Run `callback` after `delay`.
+    ///
+    /// Replaces any timer already scheduled for `key`
+    auto schedule(unsigned key, std::chrono::milliseconds delay, Callback callback) -> void;
+
+    /// Cancel the timer scheduled for `key`
+    ///
+    /// \returns false if no timer was scheduled for `key`
+    auto cancel(unsigned key) -> bool;
+
+    auto size() const noexcept -> std::size_t
+    {
+      return _timers.size();
+    }
+
+  private:
+    struct Entry {
+      unsigned key;
+      Callback callback;
+    };
+
+    auto rearm() -> void;
+    auto on_timeout() -> bool;
+
+    std::multimap<clock::time_point, Entry> _timers;
+    std::unordered_map<unsigned, decltype(_timers)::iterator> _by_key;
+    sigc::connection _timeout;
+    clock::time_point _armed_for;
+  };
+
+} // namespace cloth::notifications